@@ -20,10 +20,31 @@
 #include <linux/interrupt.h>
 #include <linux/timer.h>
 #include <linux/input.h>
+#include <linux/delay.h>
+#include <linux/dmi.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#include <linux/list.h>
+#include <linux/string.h>
+#include <linux/pm_qos.h>
+#include <linux/sysfs.h>
+#include <linux/timex.h>
+#include <linux/platform_device.h>
+#include <linux/pm_wakeup.h>
+#include <net/genetlink.h>
 
 #include <asm/io.h>
 #include <asm/bitops.h>
 
+#include "i8042_driver.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Danish Makbari Alexandrovich");
 MODULE_DESCRIPTION("Driver for PS/2 devices");
@@ -37,6 +58,9 @@ MODULE_DESCRIPTION("Driver for PS/2 devices");
 #define I8042_STATUS_REG 0x64
 #define I8042_COMMAND_REG 0x64
 
+/* Maximum number of bytes that can be drained from output buffer */
+#define I8042_BUFFER_SIZE 16
+
 /* Commmands for i8042 controller */
 #define I8042_READ_CONFIG_BYTE 0x20
 #define I8042_WRITE_CONFIG_BYTE 0x60
@@ -55,11 +79,17 @@ MODULE_DESCRIPTION("Driver for PS/2 devices");
 
 /* Host-to-keyboard communication */
 #define I8042_RESET 0xFF
+#define I8042_SET_DEFAULTS 0xF6
 #define I8042_DISABLE_SCANNING 0xF5
 #define I8042_IDENTIFY 0xF2
 #define I8042_CAPSLOCK 0xED
 #define I8042_KBD_ENABLE 0xF4
 #define I8042_KBD_DISABLE 0xF5
+#define I8042_SET_RATE 0xF3
+#define I8042_SET_RESOLUTION 0xE8
+#define I8042_ECHO 0xEE
+#define I8042_SCANCODE_SET 0xF0
+#define I8042_SET_ALL_MBR 0xFA
 
 /* Keyboard-to-host communication */
 #define I8042_ACK 0xFA
@@ -68,14 +98,325 @@ MODULE_DESCRIPTION("Driver for PS/2 devices");
 #define I8042_RESEND_REQUEST 0xFE
 #define I8042_ERROR1 0x00
 #define I8042_ERROR2 0xFF
+#define I8042_MOUSE_ERROR 0xFC
+
+/* Platform quirks */
+#define I8042_QUIRK_NOSELFTEST 0x01	/* self test resets the controller */
+#define I8042_QUIRK_NOAUX 0x02		/* no second port */
+#define I8042_QUIRK_LONGBAT 0x04	/* devices need long BAT wait */
+#define I8042_QUIRK_POLL 0x08		/* interrupts are not usable */
+#define I8042_QUIRK_NOPORTTEST 0x10	/* known-good ports, skip interface tests */
 
 /* Devices */
 #define UNDEFINED 0
 #define KEYBOARD 1
 #define MOUSE 2
 
-static int first_port = 0, second_port = 0;
-static struct input_dev *dev1, *dev2;
+/* Bytes drained in irq are kept here until bottom half decodes them */
+#define I8042_RING_SIZE 64
+
+struct i8042_byte {
+	uint8_t data;
+	ktime_t t;			/* arrival time */
+};
+
+/* Events decoded in one bottom half pass are delivered to input core at once */
+#define I8042_BATCH_SIZE 32
+
+struct i8042_batch {
+	struct input_value vals[I8042_BATCH_SIZE];
+	int nvals;
+	ktime_t stamps[I8042_BATCH_SIZE];	/* arrival of batched packets */
+	int npackets;
+	int motion;			/* batch has relative motion */
+	ktime_t stamp;			/* smoothed time of last batched packet */
+};
+
+/* Latency histogram has log2 buckets starting from 1 us */
+#define I8042_HIST_SIZE 12
+
+struct i8042_stats {
+	u64 events;
+	u64 lat_sum_ns;
+	u64 lat_max_ns;
+	u32 lat_hist[I8042_HIST_SIZE];
+	u32 overflows;
+
+	/* Command path */
+	u64 cmds;
+	u64 cmd_lat_sum_ns;
+	u64 cmd_lat_max_ns;
+	u32 cmd_hist[I8042_HIST_SIZE];
+	u32 cmd_errors;
+
+	/* Delivery cost */
+	u64 input_calls;
+	u64 cycles;
+
+	/* Command pacing */
+	u32 cmd_deferred;		/* held until stream boundary or idle gap */
+	u32 cmd_avoided;		/* held while packet was in flight and it completed */
+	u32 cmd_forced;			/* sent mid-packet after pacing deadline */
+};
+
+/* Tracks device sample clock to smooth packet timestamps */
+struct i8042_clock {
+	int locked;
+	int reset;			/* sample rate was changed */
+	s64 nominal_ns;
+	s64 period_ns;			/* estimated sample period */
+	ktime_t phase;			/* smoothed time of last packet */
+	u64 samples;
+	u64 jitter_sum_ns;		/* residual of raw time against estimate */
+	u64 jitter_max_ns;
+};
+
+
+struct i8042_port {
+	int num;			/* 1 or 2 */
+	int present;			/* interface test passed */
+	int type;			/* UNDEFINED, KEYBOARD or MOUSE */
+	int irq;
+	int irq_on;
+	uint8_t irq_bit;		/* interrupt enable bit in config byte */
+	const char *name;
+	const char *dev_name;
+	struct input_dev *dev;
+	uint8_t id;			/* first byte of identify response */
+	uint8_t id2;			/* second byte for keyboards */
+
+	struct i8042_byte ring[I8042_RING_SIZE];
+	unsigned int head, tail;
+
+	/* Decoder bound to scan code set, keyboards only */
+	int set;
+	int (*decode)(struct i8042_port *port, uint8_t scancode);
+	const char *decoder;
+
+	/* Decoder state */
+	int e0;
+	int f0;
+	uint8_t packet[4];
+	int packet_len, packet_size;
+	ktime_t packet_t;		/* arrival of first packet byte */
+	unsigned int rate;		/* mouse samples per second */
+	struct i8042_clock clock;
+
+	/* Command engine state, responses are taken from drained bytes */
+	struct list_head cmd_queue;
+	struct i8042_cmd *cmd;		/* command in flight */
+	int cmd_ack;			/* waiting for acknowledge */
+	int cmd_final;			/* acknowledge is for last command byte */
+	int cmd_got;			/* response bytes received */
+	uint8_t cmd_reply;		/* acknowledge or error byte */
+	struct completion cmd_done;
+	ktime_t last_rx;		/* arrival of last stream byte */
+
+	/* Keyboard LEDs are sent through command engine */
+	struct work_struct led_work;
+	uint8_t leds;
+
+	struct i8042_batch batch;
+	struct i8042_stats stats;
+};
+
+static struct i8042_port ports[] = {
+	{ .num = 1, .irq = I8042_IRQ1, .irq_bit = 0, .name = "first", .dev_name = "i8042_dev1",
+	  .cmd_queue = LIST_HEAD_INIT(ports[0].cmd_queue) },
+	{ .num = 2, .irq = I8042_IRQ12, .irq_bit = 1, .name = "second", .dev_name = "i8042_dev2",
+	  .cmd_queue = LIST_HEAD_INIT(ports[1].cmd_queue) },
+};
+
+/* Settings applied together by profile parameter */
+struct i8042_profile {
+	const char *name;
+	uint8_t mouse_rate;		/* samples per second */
+	uint8_t mouse_resolution;	/* 0..3, 1 << n counts per mm */
+	uint8_t typematic;		/* keyboard repeat delay and rate */
+	int soft_repeat;		/* repeat done by input core */
+	unsigned int mouse_budget;
+	unsigned int poll_period;
+	int instrument;
+	unsigned int qos_window;
+};
+
+static const struct i8042_profile profiles[] = {
+	{ .name = "latency", .mouse_rate = 200, .mouse_resolution = 3, .typematic = 0x20,
+	  .soft_repeat = 0, .mouse_budget = 64, .poll_period = 2, .instrument = 0,
+	  .qos_window = 5000 },
+	{ .name = "balanced", .mouse_rate = 100, .mouse_resolution = 2, .typematic = 0x2B,
+	  .soft_repeat = 0, .mouse_budget = 24, .poll_period = 10, .instrument = 1,
+	  .qos_window = 1000 },
+	{ .name = "power", .mouse_rate = 40, .mouse_resolution = 2, .typematic = 0x7F,
+	  .soft_repeat = 1, .mouse_budget = 12, .poll_period = 20, .instrument = 0,
+	  .qos_window = 0 },
+};
+
+/* Balanced profile matches device defaults, so it is not sent unless asked */
+static const struct i8042_profile *profile = &profiles[1];
+static int profile_set;
+static DEFINE_MUTEX(profile_mutex);
+static int soft_repeat;
+static int instrument = 1;
+
+/* CPU wakeup latency is limited while input was seen within qos_window */
+static unsigned int qos_window = 1000;
+module_param(qos_window, uint, 0644);
+MODULE_PARM_DESC(qos_window, "Inactivity in ms after which CPU latency request is dropped, 0 disables it");
+
+static unsigned int qos_latency = 20;
+module_param(qos_latency, uint, 0644);
+MODULE_PARM_DESC(qos_latency, "CPU wakeup latency in us requested while input is active");
+
+static unsigned long qos_held_ms;
+module_param(qos_held_ms, ulong, 0444);
+MODULE_PARM_DESC(qos_held_ms, "Total time CPU latency request was held");
+
+static struct pm_qos_request qos_req;
+static int qos_active;
+static unsigned long qos_last;		/* jiffies of last byte */
+static ktime_t qos_start;
+static DEFINE_MUTEX(qos_mutex);
+
+/* Phases probed synchronously at init, the rest is deferred to a work */
+#define I8042_EARLY_AUX 0x01
+#ifdef MODULE
+static unsigned int early_phases = I8042_EARLY_AUX;
+#else
+static unsigned int early_phases;
+#endif
+module_param(early_phases, uint, 0444);
+MODULE_PARM_DESC(early_phases, "Phases probed synchronously at init (1=second port)");
+
+/* Keyboard bytes are always decoded first, mouse bytes are limited per pass */
+static unsigned int mouse_budget = 24;
+
+/* Zero budget would leave mouse bytes undecoded and reschedule bottom half forever */
+static int mouse_budget_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int n;
+
+	if (kstrtouint(val, 0, &n) || !n)
+		return -EINVAL;
+	WRITE_ONCE(mouse_budget, n);
+	return 0;
+}
+
+static const struct kernel_param_ops mouse_budget_ops = {
+	.set = mouse_budget_set,
+	.get = param_get_uint,
+};
+module_param_cb(mouse_budget, &mouse_budget_ops, &mouse_budget, 0644);
+MODULE_PARM_DESC(mouse_budget, "Mouse bytes decoded per bottom half pass");
+
+static bool batch_events = true;
+module_param(batch_events, bool, 0644);
+MODULE_PARM_DESC(batch_events, "Deliver events once per bottom half pass with single SYN_REPORT");
+
+static DEFINE_SPINLOCK(i8042_lock);
+
+/* Serialises controller traffic of probe, config updates, commands and loopback */
+static DEFINE_MUTEX(i8042_mutex);
+
+static unsigned int flushed_bytes;
+module_param(flushed_bytes, uint, 0444);
+MODULE_PARM_DESC(flushed_bytes, "Number of stale bytes discarded from output buffer");
+
+static unsigned int quirks;
+module_param(quirks, uint, 0444);
+MODULE_PARM_DESC(quirks, "Quirk flags ORed with DMI table (1=noselftest, 2=noaux, 4=longbat, 8=poll, 16=noporttest)");
+
+/* Probed state passed to the next kernel on kexec through command line */
+struct i8042_handover {
+	int valid;
+	uint8_t config;
+	struct {
+		int type;
+		uint8_t id, id2, set;
+		unsigned int rate;
+	} port[2];
+};
+
+static struct i8042_handover handover;
+static uint8_t config_byte;		/* last value written to controller */
+
+/* Time limits in milliseconds */
+static unsigned long cmd_timeout = 250;
+static unsigned long bat_timeout = 500;
+#define I8042_ID_WAIT 20
+
+/* Non-urgent commands wait for packet boundary or gap in device stream */
+#define I8042_PACE_GAP 3
+static bool pace_commands = true;
+module_param(pace_commands, bool, 0644);
+MODULE_PARM_DESC(pace_commands, "Hold LED, rate, resolution and echo commands until packet boundary");
+static unsigned int pace_deadline = 50;
+module_param(pace_deadline, uint, 0644);
+MODULE_PARM_DESC(pace_deadline, "Milliseconds paced command may wait for packet boundary");
+
+/* Poll timer serves ports without working irq */
+static unsigned int poll_period = 10;
+static struct timer_list poll_timer;
+static int poll_timer_on;
+
+/* Loopback injects bytes with 0xD2/0xD3 as if they were sent by device */
+#define I8042_LOOPBACK_WAIT 10
+#define I8042_LOOPBACK_MAX 10000
+
+struct i8042_loopback {
+	int active;
+	int port;
+	int running;			/* port of benchmark run, its bytes are not decoded */
+	uint8_t expected;
+	ktime_t sent;
+	s64 write_irq_ns;		/* last write-to-irq latency */
+	s64 irq_evdev_ns;		/* last irq-to-evdev latency */
+	struct completion done;
+	struct mutex mutex;
+
+	/* Results of the last benchmark run */
+	unsigned int count, timeouts, mismatches;
+	s64 write_irq_min, write_irq_max, write_irq_sum;
+	s64 irq_evdev_max, irq_evdev_sum;
+};
+
+static struct i8042_loopback loopback;
+static struct dentry *debugfs_dir;
+
+/* Bytes found in output buffer on resume, they are usually the key that woke system */
+struct i8042_wake {
+	int armed;			/* irq wake is enabled */
+	int irq;			/* keyboard irq armed for wake */
+	ktime_t resumed;		/* start of resume, cleared by first event */
+	s64 latency_ns;			/* last resume-to-first-event latency */
+	int count;
+	struct i8042_byte bytes[I8042_BUFFER_SIZE];
+	int port[I8042_BUFFER_SIZE];
+};
+
+static struct i8042_wake wake;
+static struct platform_device *i8042_pdev;
+
+static const struct dmi_system_id i8042_dmi_quirks[] = {
+	{
+		/* Emulated controller always passes tests */
+		.ident = "QEMU",
+		.matches = {
+			DMI_MATCH(DMI_SYS_VENDOR, "QEMU"),
+		},
+		.driver_data = (void *) (I8042_QUIRK_NOSELFTEST | I8042_QUIRK_NOPORTTEST),
+	},
+	{
+		/* Self test breaks keyboard on ASUS notebooks */
+		.ident = "ASUS notebook",
+		.matches = {
+			DMI_MATCH(DMI_SYS_VENDOR, "ASUSTeK COMPUTER INC."),
+			DMI_MATCH(DMI_CHASSIS_TYPE, "10"),
+		},
+		.driver_data = (void *) I8042_QUIRK_NOSELFTEST,
+	},
+	{ }
+};
 
 static uint8_t press_scancodes[] = {
 				      0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
@@ -107,44 +448,569 @@ static uint8_t esc_release_scancodes[] =	{0x9C, 0x9D, 0xAA, 0xB6, 0xB8, 0xC7, 0x
 static uint8_t esc_keys[] = {	KEY_KPENTER, KEY_RIGHTCTRL, KEY_LEFTSHIFT, KEY_RIGHTSHIFT, KEY_RIGHTALT, KEY_HOME, KEY_UP, KEY_PAGEUP, KEY_LEFT, KEY_RIGHT, KEY_END, KEY_DOWN,
 			KEY_PAGEDOWN, KEY_INSERT, KEY_DELETE	};
 
-static irqreturn_t i8042_handler(int irq, void *dev_data)
+/* Set 2 and set 3 make codes in order of keys[] and esc_keys[], break codes are prefixed with 0xF0 */
+static uint8_t set2_scancodes[] = {
+				      0x76, 0x16, 0x1E, 0x26, 0x25, 0x2E, 0x36, 0x3D, 0x3E, 0x46, 0x45, 0x4E, 0x55, 0x66, 0x0D,
+				0x15, 0x1D, 0x24, 0x2D, 0x2C, 0x35, 0x3C, 0x43, 0x44, 0x4D, 0x54, 0x5B, 0x5A, 0x14, 0x1C, 0x1B,
+				0x23, 0x2B, 0x34, 0x33, 0x3B, 0x42, 0x4B, 0x4C, 0x52, 0x0E, 0x12, 0x5D, 0x1A, 0x22, 0x21, 0x2A,
+				0x32, 0x31, 0x3A, 0x41, 0x49, 0x4A, 0x59, 0x7C, 0x11, 0x29, 0x58, 0x05, 0x06, 0x04, 0x0C, 0x03,
+				0x0B, 0x83, 0x0A, 0x01, 0x09, 0x77, 0x7E, 0x6C, 0x75, 0x7D, 0x7B, 0x6B, 0x73, 0x74, 0x79, 0x69,
+				0x72, 0x7A, 0x70, 0x71,                   0x78, 0x07
+																};
+static uint8_t set2_esc_scancodes[] =	{0x5A, 0x14, 0x12, 0x59, 0x11, 0x6C, 0x75, 0x7D, 0x6B, 0x74, 0x69, 0x72, 0x7A, 0x70, 0x71};
+
+static uint8_t set3_scancodes[] = {
+				      0x08, 0x16, 0x1E, 0x26, 0x25, 0x2E, 0x36, 0x3D, 0x3E, 0x46, 0x45, 0x4E, 0x55, 0x66, 0x0D,
+				0x15, 0x1D, 0x24, 0x2D, 0x2C, 0x35, 0x3C, 0x43, 0x44, 0x4D, 0x54, 0x5B, 0x5A, 0x11, 0x1C, 0x1B,
+				0x23, 0x2B, 0x34, 0x33, 0x3B, 0x42, 0x4B, 0x4C, 0x52, 0x0E, 0x12, 0x5C, 0x1A, 0x22, 0x21, 0x2A,
+				0x32, 0x31, 0x3A, 0x41, 0x49, 0x4A, 0x59, 0x7E, 0x19, 0x29, 0x14, 0x07, 0x0F, 0x17, 0x1F, 0x27,
+				0x2F, 0x37, 0x3F, 0x47, 0x4F, 0x76, 0x5F, 0x6C, 0x75, 0x7D, 0x84, 0x6B, 0x73, 0x74, 0x7C, 0x69,
+				0x72, 0x7A, 0x70, 0x71,                   0x56, 0x5E
+																};
+/* Set 3 has unique codes for extended keys and no fake shifts, 0x00 marks missing code */
+static uint8_t set3_esc_scancodes[] =	{0x79, 0x58, 0x00, 0x00, 0x39, 0x6E, 0x63, 0x6F, 0x61, 0x6A, 0x65, 0x60, 0x6D, 0x67, 0x64};
+
+/* Delivers injected byte to evdev as raw scancode and records latencies */
+/* Bytes other than expected one, e.g. late injected bytes, are dropped */
+static void loopback_receive(struct i8042_port *port, uint8_t byte, ktime_t t)
+{
+	if (!READ_ONCE(loopback.active) || byte != loopback.expected) {
+		loopback.mismatches++;
+		return;
+	}
+	input_event(port->dev, EV_MSC, MSC_RAW, byte);
+	input_sync(port->dev);
+	loopback.irq_evdev_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
+	loopback.write_irq_ns = ktime_to_ns(ktime_sub(t, loopback.sent));
+	WRITE_ONCE(loopback.active, 0);
+	complete(&loopback.done);
+}
+
+/* Accounts latency from byte arrival to delivery of its event */
+static void account_event(struct i8042_port *port, ktime_t t)
+{
+	u64 ns;
+	int bucket;
+
+	port->stats.events++;
+	if (unlikely(READ_ONCE(wake.resumed))) {
+		wake.latency_ns = ktime_to_ns(ktime_sub(ktime_get(), wake.resumed));
+		WRITE_ONCE(wake.resumed, 0);
+		printk(KERN_INFO "i8042: first event %lld us after resume\n",
+		       div_s64(wake.latency_ns, NSEC_PER_USEC));
+	}
+	if (!instrument)
+		return;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), t));
+	bucket = min_t(int, fls64(ns >> 10), I8042_HIST_SIZE - 1);
+	port->stats.lat_sum_ns += ns;
+	port->stats.lat_max_ns = max(port->stats.lat_max_ns, ns);
+	port->stats.lat_hist[bucket]++;
+}
+
+/* Hardware repeat is reported as autorepeat unless input core repeats keys */
+static int make_value(struct input_dev *dev, unsigned int code)
+{
+	return test_bit(code, dev->key) && !soft_repeat ? 2 : 1;
+}
+
+/* Passes batched events to input core and closes them with one SYN_REPORT */
+static void batch_flush(struct i8042_port *port)
+{
+	int i;
+	struct i8042_batch *batch = &port->batch;
+
+	if (batch->nvals) {
+		for (i = 0; i < batch->nvals; i++)
+			input_event(port->dev, batch->vals[i].type, batch->vals[i].code,
+				    batch->vals[i].value);
+		if (batch->stamp)
+			input_set_timestamp(port->dev, batch->stamp);
+		input_sync(port->dev);
+		port->stats.input_calls += batch->nvals + 1;
+	}
+	for (i = 0; i < batch->npackets; i++)
+		account_event(port, batch->stamps[i]);
+	batch->nvals = 0;
+	batch->npackets = 0;
+	batch->motion = 0;
+	batch->stamp = 0;
+}
+
+/*
+ * Queues event, motion is summed and repeated key states are dropped.
+ * Key change after motion flushes the batch, so motion is never moved
+ * across a button change and summed motion is always after last key.
+ */
+static void batch_event(struct i8042_port *port, unsigned int type, unsigned int code, int value)
+{
+	int i;
+	struct i8042_batch *batch = &port->batch;
+
+	if (!batch_events) {
+		input_event(port->dev, type, code, value);
+		port->stats.input_calls++;
+		return;
+	}
+	for (i = batch->nvals - 1; i >= 0; i--) {
+		if (batch->vals[i].type != type || batch->vals[i].code != code)
+			continue;
+		if (type == EV_REL) {
+			batch->vals[i].value += value;
+			return;
+		}
+		if (type == EV_MSC) {
+			batch->vals[i].value = value;
+			return;
+		}
+		/* Autorepeat is never merged or dropped */
+		if (value != 2 && !!batch->vals[i].value == value)
+			return;
+		break;
+	}
+	/* Same check as input core does, but without taking its lock */
+	if (i < 0 && type == EV_KEY && value != 2 && !!test_bit(code, port->dev->key) == value)
+		return;
+	if (batch->nvals == I8042_BATCH_SIZE || (type == EV_KEY && batch->motion))
+		batch_flush(port);
+	if (type == EV_REL)
+		batch->motion = 1;
+	batch->vals[batch->nvals].type = type;
+	batch->vals[batch->nvals].code = code;
+	batch->vals[batch->nvals].value = value;
+	batch->nvals++;
+}
+
+/* Value is 0 for release, 1 for press and 2 for autorepeat */
+static void batch_key(struct i8042_port *port, unsigned int code, int value)
+{
+	batch_event(port, EV_KEY, code, value);
+}
+
+/* Sets smoothed time of packet, it is called after packet events so earlier flush doesn't take it */
+static void batch_stamp(struct i8042_port *port, ktime_t t)
+{
+	if (!batch_events)
+		input_set_timestamp(port->dev, t);
+	else
+		port->batch.stamp = t;
+}
+
+/* Ends decoded packet, it is delivered now or with the rest of batch */
+static void batch_packet(struct i8042_port *port, ktime_t t)
+{
+	struct i8042_batch *batch = &port->batch;
+
+	if (!batch_events) {
+		input_sync(port->dev);
+		port->stats.input_calls++;
+		account_event(port, t);
+		return;
+	}
+	if (batch->npackets == I8042_BATCH_SIZE)
+		batch_flush(port);
+	batch->stamps[batch->npackets++] = t;
+}
+
+/* Decodes set 1 scancode, returns 1 if key event was reported */
+static int decode_set1(struct i8042_port *port, uint8_t scancode)
 {
 	int i;
-	uint8_t scancode;
-	struct input_dev *dev = (struct input_dev *) dev_data;
-	scancode = inb(I8042_DATA_REG);
-	if (irq == I8042_IRQ1) {
-		/* Keyboard driver */
-		if (scancode != 0xE0) {
-			for (i = 0; i < 85; i++) {
-				if (scancode == press_scancodes[i]) {
-					input_report_key(dev, keys[i], 1);
-					break;
-				} else if (scancode == release_scancodes[i]) {
-					input_report_key(dev, keys[i], 0);
-					break;
-				}
+	struct input_dev *dev = port->dev;
+
+	if (scancode == 0xE0) {
+		port->e0 = 1;
+		return 0;
+	}
+	if (!port->e0) {
+		for (i = 0; i < 85; i++) {
+			if (scancode == press_scancodes[i]) {
+				batch_key(port, keys[i], make_value(dev, keys[i]));
+				return 1;
+			} else if (scancode == release_scancodes[i]) {
+				batch_key(port, keys[i], 0);
+				return 1;
+			}
+		}
+	} else {
+		port->e0 = 0;
+		for (i = 0; i < 15; i++) {
+			if (scancode == esc_press_scancodes[i]) {
+				batch_key(port, esc_keys[i], make_value(dev, esc_keys[i]));
+				return 1;
+			} else if (scancode == esc_release_scancodes[i]) {
+				batch_key(port, esc_keys[i], 0);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Returns smoothed packet time, raw time is used until tracker locks */
+static ktime_t clock_track(struct i8042_port *port, ktime_t raw)
+{
+	s64 err;
+	ktime_t predicted;
+	struct i8042_clock *c = &port->clock;
+
+	if (READ_ONCE(c->reset)) {
+		WRITE_ONCE(c->reset, 0);
+		c->locked = 0;
+		c->nominal_ns = NSEC_PER_SEC / port->rate;
+		c->period_ns = c->nominal_ns;
+	}
+	if (c->locked) {
+		predicted = ktime_add_ns(c->phase, c->period_ns);
+		err = ktime_to_ns(ktime_sub(raw, predicted));
+		/* Mouse sends nothing while idle, gaps make tracker lock again */
+		if (abs(err) < c->period_ns / 2) {
+			c->phase = ktime_add_ns(predicted, err / 8);
+			c->period_ns = clamp(c->period_ns + err / 64,
+					     div_s64(c->nominal_ns * 9, 10), div_s64(c->nominal_ns * 11, 10));
+			c->samples++;
+			c->jitter_sum_ns += abs(err);
+			c->jitter_max_ns = max_t(u64, c->jitter_max_ns, abs(err));
+			return c->phase;
+		}
+	}
+	c->phase = raw;
+	c->locked = 1;
+	return raw;
+}
+
+/* Decodes set 2 scancode, returns 1 if key event was reported */
+static int decode_set2(struct i8042_port *port, uint8_t scancode)
+{
+	int i, value;
+	struct input_dev *dev = port->dev;
+
+	if (scancode == 0xE0) {
+		port->e0 = 1;
+		return 0;
+	}
+	if (scancode == 0xF0) {
+		port->f0 = 1;
+		return 0;
+	}
+	if (!port->e0) {
+		for (i = 0; i < 85; i++) {
+			if (scancode == set2_scancodes[i]) {
+				value = port->f0 ? 0 : make_value(dev, keys[i]);
+				port->f0 = 0;
+				batch_key(port, keys[i], value);
+				return 1;
+			}
+		}
+	} else {
+		for (i = 0; i < 15; i++) {
+			if (scancode == set2_esc_scancodes[i]) {
+				value = port->f0 ? 0 : make_value(dev, esc_keys[i]);
+				port->e0 = port->f0 = 0;
+				batch_key(port, esc_keys[i], value);
+				return 1;
 			}
+		}
+	}
+	port->e0 = port->f0 = 0;
+	return 0;
+}
+
+/* Decodes set 3 scancode, returns 1 if key event was reported */
+static int decode_set3(struct i8042_port *port, uint8_t scancode)
+{
+	int i, value;
+	struct input_dev *dev = port->dev;
+
+	if (scancode == 0xF0) {
+		port->f0 = 1;
+		return 0;
+	}
+	for (i = 0; i < 85; i++) {
+		if (scancode == set3_scancodes[i]) {
+			value = port->f0 ? 0 : make_value(dev, keys[i]);
+			port->f0 = 0;
+			batch_key(port, keys[i], value);
+			return 1;
+		}
+	}
+	for (i = 0; i < 15; i++) {
+		if (scancode && scancode == set3_esc_scancodes[i]) {
+			value = port->f0 ? 0 : make_value(dev, esc_keys[i]);
+			port->f0 = 0;
+			batch_key(port, esc_keys[i], value);
+			return 1;
+		}
+	}
+	port->f0 = 0;
+	return 0;
+}
+
+/* Collects mouse packet, returns 1 if packet was reported */
+static int mouse_decode(struct i8042_port *port, uint8_t byte, ktime_t t)
+{
+	int dx, dy;
+	uint8_t *p = port->packet;
+
+	/* Bit 3 is always set in first byte, otherwise stream is out of sync */
+	if (port->packet_len == 0 && !test_bit(3, (void *) &byte))
+		return 0;
+	if (port->packet_len == 0)
+		port->packet_t = t;
+	p[port->packet_len++] = byte;
+	if (port->packet_len < port->packet_size)
+		return 0;
+	port->packet_len = 0;
+
+	dx = p[1] - ((p[0] << 4) & 0x100);
+	dy = p[2] - ((p[0] << 3) & 0x100);
+	batch_key(port, BTN_LEFT, !!(p[0] & 0x01));
+	batch_key(port, BTN_RIGHT, !!(p[0] & 0x02));
+	batch_key(port, BTN_MIDDLE, !!(p[0] & 0x04));
+	batch_event(port, EV_REL, REL_X, dx);
+	batch_event(port, EV_REL, REL_Y, -dy);
+	if (port->id == 0x03) {
+		batch_event(port, EV_REL, REL_WHEEL, -(int8_t) p[3]);
+	} else if (port->id == 0x04) {
+		batch_event(port, EV_REL, REL_WHEEL, -sign_extend32(p[3] & 0x0F, 3));
+		batch_key(port, BTN_SIDE, !!(p[3] & 0x10));
+		batch_key(port, BTN_EXTRA, !!(p[3] & 0x20));
+	}
+	/*
+	 * Frame carries smoothed time, raw arrival is kept in MSC_TIMESTAMP. Both
+	 * come after packet events, button change may flush previous packets.
+	 */
+	batch_event(port, EV_MSC, MSC_TIMESTAMP, (u32) ktime_to_us(port->packet_t));
+	batch_stamp(port, clock_track(port, port->packet_t));
+	return 1;
+}
+
+/* Takes byte from port ring, returns 0 if ring is empty */
+static int ring_pop(struct i8042_port *port, struct i8042_byte *b)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&i8042_lock, flags);
+	if (port->tail != port->head) {
+		*b = port->ring[port->tail];
+		port->tail = (port->tail + 1) % I8042_RING_SIZE;
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&i8042_lock, flags);
+	return ret;
+}
+
+static int ring_empty(struct i8042_port *port)
+{
+	return READ_ONCE(port->tail) == READ_ONCE(port->head);
+}
+
+/* Decodes drained bytes, keyboard is served before mouse */
+static void i8042_bh(struct tasklet_struct *t)
+{
+	int i;
+	unsigned int budget;
+	cycles_t start;
+	struct i8042_byte b;
+	struct i8042_port *port;
+
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		port = &ports[i];
+		if (!port->dev || port->type != KEYBOARD)
+			continue;
+		start = get_cycles();
+		while (ring_pop(port, &b))
+			if (port->decode(port, b.data))
+				batch_packet(port, b.t);
+		batch_flush(port);
+		port->stats.cycles += get_cycles() - start;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		port = &ports[i];
+		if (!port->dev || port->type != MOUSE)
+			continue;
+		start = get_cycles();
+		for (budget = READ_ONCE(mouse_budget); budget && ring_pop(port, &b); budget--)
+			if (mouse_decode(port, b.data, b.t))
+				batch_packet(port, b.t);
+		batch_flush(port);
+		port->stats.cycles += get_cycles() - start;
+	}
+
+	/* Rest of mouse bytes waits for next pass, so new keys get ahead of them */
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		if (ports[i].dev && !ring_empty(&ports[i])) {
+			tasklet_schedule(t);
+			break;
+		}
+	}
+}
+
+static DECLARE_TASKLET(i8042_tasklet, i8042_bh);
+
+static void qos_off_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(qos_off_work, qos_off_fn);
+
+static void qos_on_fn(struct work_struct *work)
+{
+	mutex_lock(&qos_mutex);
+	if (!qos_active && qos_window) {
+		cpu_latency_qos_add_request(&qos_req, qos_latency);
+		qos_active = 1;
+		qos_start = ktime_get();
+		mod_delayed_work(system_wq, &qos_off_work, msecs_to_jiffies(qos_window));
+	}
+	mutex_unlock(&qos_mutex);
+}
+
+static DECLARE_WORK(qos_on_work, qos_on_fn);
+
+/* Drops latency request once ports were idle for qos_window */
+static void qos_off_fn(struct work_struct *work)
+{
+	unsigned long idle_end;
+
+	mutex_lock(&qos_mutex);
+	if (qos_active) {
+		idle_end = READ_ONCE(qos_last) + msecs_to_jiffies(qos_window);
+		if (qos_window && time_before(jiffies, idle_end)) {
+			mod_delayed_work(system_wq, &qos_off_work, idle_end - jiffies);
 		} else {
-			scancode = inb(I8042_DATA_REG);
-			for (i = 0; i < 15; i++) {
-				if (scancode == esc_press_scancodes[i]) {
-					input_report_key(dev, esc_keys[i], 1);
-					break;
-				} else if (scancode == esc_release_scancodes[i]) {
-					input_report_key(dev, esc_keys[i], 0);
-					break;
-				}
+			cpu_latency_qos_remove_request(&qos_req);
+			qos_active = 0;
+			qos_held_ms += ktime_ms_delta(ktime_get(), qos_start);
+		}
+	}
+	mutex_unlock(&qos_mutex);
+}
+
+/* Takes byte as response to command in flight, returns 1 if it was taken */
+static int cmd_receive(struct i8042_port *port, uint8_t byte)
+{
+	struct i8042_cmd *cmd = port->cmd;
+
+	if (!cmd)
+		return 0;
+	/* Echo is answered with 0xEE instead of acknowledge */
+	if (port->cmd_ack && port->cmd_final && cmd->bytes[cmd->nbytes - 1] == I8042_ECHO &&
+	    byte == I8042_ECHO_RESPONSE) {
+		port->cmd_reply = I8042_ACK;
+		port->cmd_ack = 0;
+		if (cmd->nresp)
+			cmd->resp[port->cmd_got++] = byte;
+		complete(&port->cmd_done);
+		return 1;
+	}
+	if (port->cmd_ack) {
+		/* Scancodes and packets sent before command are still decoded */
+		if (byte != I8042_ACK && byte != I8042_RESEND_REQUEST && byte != I8042_MOUSE_ERROR)
+			return 0;
+		port->cmd_reply = byte;
+		port->cmd_ack = 0;
+		if (byte != I8042_ACK || !port->cmd_final || !cmd->nresp)
+			complete(&port->cmd_done);
+		return 1;
+	}
+	if (port->cmd_final && port->cmd_got < cmd->nresp) {
+		cmd->resp[port->cmd_got++] = byte;
+		if (port->cmd_got == cmd->nresp)
+			complete(&port->cmd_done);
+		return 1;
+	}
+	return 0;
+}
+
+/* Drains output buffer into port rings, status bit 5 tells the source port */
+static int i8042_drain(void)
+{
+	int count = 0;
+	unsigned long flags;
+	unsigned int next;
+	uint8_t status, byte;
+	struct i8042_port *port;
+	ktime_t t;
+
+	spin_lock_irqsave(&i8042_lock, flags);
+	status = inb(I8042_STATUS_REG);
+	while (test_bit(0, (void *) &status) && count < I8042_BUFFER_SIZE) {
+		port = &ports[test_bit(5, (void *) &status) ? 1 : 0];
+		/* Bytes of port in probe are left to its prober */
+		if (!port->dev)
+			break;
+		t = ktime_get();
+		byte = inb(I8042_DATA_REG);
+		count++;
+		if (READ_ONCE(loopback.running) == port->num) {
+			loopback_receive(port, byte, t);
+		} else if (!cmd_receive(port, byte)) {
+			next = (port->head + 1) % I8042_RING_SIZE;
+			if (next == port->tail) {
+				port->stats.overflows++;
+			} else {
+				port->ring[port->head].data = byte;
+				port->ring[port->head].t = t;
+				port->head = next;
 			}
+			port->last_rx = t;
 		}
-	} else if (irq == I8042_IRQ12) {
-		/* Mouse driver */
+		status = inb(I8042_STATUS_REG);
+	}
+	spin_unlock_irqrestore(&i8042_lock, flags);
+
+	if (count) {
+		tasklet_schedule(&i8042_tasklet);
+		WRITE_ONCE(qos_last, jiffies);
+		if (READ_ONCE(qos_window) && !READ_ONCE(qos_active))
+			schedule_work(&qos_on_work);
+	}
+	return count;
+}
+
+static irqreturn_t i8042_handler(int irq, void *dev_data)
+{
+	return IRQ_RETVAL(i8042_drain());
+}
 
+/* Polls output buffer when interrupts are not usable */
+static void i8042_poll(struct timer_list *t)
+{
+	i8042_drain();
+	mod_timer(&poll_timer, jiffies + msecs_to_jiffies(poll_period));
+}
 
+/* Starts poll timer if some registered port has no irq */
+static void start_polling(void)
+{
+	int i;
+	if (poll_timer_on)
+		return;
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		if (ports[i].dev && !ports[i].irq_on) {
+			timer_setup(&poll_timer, i8042_poll, 0);
+			mod_timer(&poll_timer, jiffies + msecs_to_jiffies(poll_period));
+			poll_timer_on = 1;
+			return;
+		}
 	}
+}
 
-	input_sync(dev);
-	return IRQ_HANDLED;
+static int request_port_irq(struct i8042_port *port)
+{
+	if (quirks & I8042_QUIRK_POLL)
+		return 0;
+	if (request_irq(port->irq, i8042_handler, IRQF_SHARED, port->dev_name, port))
+		return -1;
+	port->irq_on = 1;
+	return 0;
+}
+
+static void free_port_irq(struct i8042_port *port)
+{
+	if (port->irq_on)
+		free_irq(port->irq, port);
+	port->irq_on = 0;
 }
 
 /* Reads value from data register */
@@ -199,57 +1065,523 @@ static int write_dev2(uint8_t byte, unsigned long wait_time)
 	return -1;
 }
 
-int init_module(void)
+/* Drains output buffer until it is empty, returns number of discarded bytes */
+static int flush_output(void)
 {
-	int error;
-	uint8_t byte, dual_channel_test;
+	int count = 0;
+	uint8_t status = inb(I8042_STATUS_REG);
+	while (test_bit(0, (void *) &status)) {
+		if (count == I8042_BUFFER_SIZE) {
+			flushed_bytes += count;
+			return -1;
+		}
+		inb(I8042_DATA_REG);
+		count++;
+		udelay(50);
+		status = inb(I8042_STATUS_REG);
+	}
+	flushed_bytes += count;
+	return count;
+}
 
-	/* This code disables PS/2 ports */
-	outb(I8042_DISABLE_FIRST_PS2_PORT, I8042_COMMAND_REG);
-	outb(I8042_DISABLE_SECOND_PS2_PORT, I8042_COMMAND_REG);
+/* Writes to the device on given port */
+static int write_dev(int port, uint8_t byte, unsigned long wait_time)
+{
+	if (port == 1)
+		return write_dev1(byte, wait_time);
+	return write_dev2(byte, wait_time);
+}
 
-	/* This code flushes output buffer */
-	outb(I8042_READ_CONFIG_BYTE, I8042_COMMAND_REG);
-	if (read_reg(&byte, 250) < 0) {
-		printk(KERN_ERR "i8042: time limit exceeded\n");
-		return -ETIME;
+/* Sends command to the device and waits for acknowledge */
+static int command_dev(int port, uint8_t cmd)
+{
+	uint8_t byte;
+	if (write_dev(port, cmd, cmd_timeout) < 0)
+		return -1;
+	if (read_reg(&byte, cmd_timeout) < 0)
+		return -1;
+	return byte == I8042_ACK ? 0 : -1;
+}
+
+/* Resets the device and consumes its BAT result and id */
+static int reset_dev(int port)
+{
+	uint8_t byte;
+	if (command_dev(port, I8042_RESET) < 0)
+		return -1;
+	if (read_reg(&byte, bat_timeout) < 0 || byte != I8042_SELF_TEST_PASSED)
+		return -1;
+	/* Mice send their id right after BAT, keyboards send nothing */
+	read_reg(&byte, I8042_ID_WAIT);
+	if (flush_output() < 0)
+		printk(KERN_WARNING "i8042: can't flush output buffer\n");
+	return 0;
+}
+
+/* Identifies the device on given port, returns its type */
+static int identify_dev(struct i8042_port *port)
+{
+	uint8_t byte, byte2;
+	const char *name = port->name;
+
+	if (command_dev(port->num, I8042_DISABLE_SCANNING) < 0)
+		return UNDEFINED;
+	if (command_dev(port->num, I8042_IDENTIFY) < 0)
+		return UNDEFINED;
+	if (read_reg(&byte, cmd_timeout) < 0)
+		return UNDEFINED;
+	port->id = byte;
+
+	if (byte == 0x00) {
+		printk(KERN_INFO "i8042: standard mouse on %s port\n", name);
+		return MOUSE;
+	} else if (byte == 0x03) {
+		printk(KERN_INFO "i8042: mouse with wheel on %s port\n", name);
+		return MOUSE;
+	} else if (byte == 0x04) {
+		printk(KERN_INFO "i8042: 5 button mouse on %s port\n", name);
+		return MOUSE;
+	} else if (byte == 0xAB) {
+		if (read_reg(&byte2, cmd_timeout) < 0)
+			return UNDEFINED;
+		port->id2 = byte2;
+		if (byte2 == 0x41 || byte2 == 0xC1) {
+			printk(KERN_INFO "i8042: MF2 keyboard with translation on %s port\n", name);
+			return KEYBOARD;
+		} else if (byte2 == 0x83) {
+			printk(KERN_INFO "i8042: MF2 keyboard on %s port\n", name);
+			return KEYBOARD;
+		}
 	}
+	return UNDEFINED;
+}
 
-	/* This code sets config byte */
-	outb(I8042_READ_CONFIG_BYTE, I8042_COMMAND_REG);
-	if (read_reg(&byte, 250) < 0) {
-		printk(KERN_ERR "i8042: time limit exceeded\n");
-		return -ETIME;
+/* Detects the device on given port, returns its type */
+static int detect_dev(struct i8042_port *port)
+{
+	int type;
+
+	/* Set defaults has no BAT delay, full reset is only a fallback */
+	if (command_dev(port->num, I8042_SET_DEFAULTS) == 0) {
+		type = identify_dev(port);
+		if (type != UNDEFINED)
+			return type;
 	}
-	__clear_bit(0, (void *) &byte);
-	__clear_bit(1, (void *) &byte);
-	__clear_bit(6, (void *) &byte);
-	outb(byte, I8042_DATA_REG);
-	if (read_reg(&byte, 250) < 0) {
+	if (flush_output() < 0)
+		printk(KERN_WARNING "i8042: can't flush output buffer\n");
+	if (reset_dev(port->num) < 0)
+		return UNDEFINED;
+	return identify_dev(port);
+}
+
+/* Sends command bytes and collects response, runs in command work only */
+static int cmd_execute(struct i8042_port *port, struct i8042_cmd *cmd)
+{
+	int i, retries;
+	unsigned long flags;
+
+	for (i = 0; i < cmd->nbytes; i++) {
+		retries = 2;
+resend:
+		spin_lock_irqsave(&i8042_lock, flags);
+		reinit_completion(&port->cmd_done);
+		port->cmd = cmd;
+		port->cmd_ack = 1;
+		port->cmd_final = i == cmd->nbytes - 1;
+		port->cmd_got = 0;
+		spin_unlock_irqrestore(&i8042_lock, flags);
+
+		if (write_dev(port->num, cmd->bytes[i], cmd_timeout) < 0)
+			return -ETIME;
+		if (!wait_for_completion_timeout(&port->cmd_done, msecs_to_jiffies(cmd_timeout)))
+			return -ETIME;
+		if (port->cmd_reply == I8042_RESEND_REQUEST && retries--)
+			goto resend;
+		if (port->cmd_reply != I8042_ACK)
+			return -EIO;
+	}
+	return 0;
+}
+
+/* Returns 1 while device is in the middle of scancode or packet */
+static int mid_packet(struct i8042_port *port)
+{
+	if (!ring_empty(port))
+		return 1;
+	if (port->type == MOUSE)
+		return READ_ONCE(port->packet_len) != 0;
+	return READ_ONCE(port->e0) || READ_ONCE(port->f0);
+}
+
+/* Writing to device inhibits its clock, so it would truncate packet in flight */
+static void cmd_pace(struct i8042_port *port, struct i8042_cmd *cmd)
+{
+	int deferred = 0;
+	unsigned long deadline = jiffies + msecs_to_jiffies(pace_deadline);
+
+	if (!pace_commands)
+		return;
+	switch (cmd->bytes[0]) {
+	case I8042_CAPSLOCK:
+	case I8042_SET_RATE:
+	case I8042_SET_RESOLUTION:
+	case I8042_ECHO:
+		break;
+	default:
+		return;
+	}
+
+	while (mid_packet(port) &&
+	       ktime_ms_delta(ktime_get(), READ_ONCE(port->last_rx)) < I8042_PACE_GAP) {
+		if (time_after(jiffies, deadline)) {
+			port->stats.cmd_forced++;
+			break;
+		}
+		deferred = 1;
+		usleep_range(200, 500);
+	}
+	if (deferred) {
+		port->stats.cmd_deferred++;
+		if (!mid_packet(port))
+			port->stats.cmd_avoided++;
+	}
+}
+
+/* Executes queued commands of all ports one by one */
+static void cmd_work_fn(struct work_struct *work)
+{
+	int i, more;
+	unsigned long flags;
+	struct i8042_cmd *cmd;
+	struct i8042_port *port;
+	ktime_t start;
+	u64 ns;
+
+	do {
+		more = 0;
+		for (i = 0; i < ARRAY_SIZE(ports); i++) {
+			port = &ports[i];
+			spin_lock_irqsave(&i8042_lock, flags);
+			cmd = list_first_entry_or_null(&port->cmd_queue, struct i8042_cmd, node);
+			if (cmd)
+				list_del(&cmd->node);
+			spin_unlock_irqrestore(&i8042_lock, flags);
+			if (!cmd)
+				continue;
+			more = 1;
+
+			/* Commands left by released port are failed */
+			if (!READ_ONCE(port->dev)) {
+				cmd->status = -ENODEV;
+				cmd->done(cmd);
+				continue;
+			}
+			/*
+			 * Command is published by cmd_execute, so loopback run can't overwrite it.
+			 * Pacing runs under the mutex, so boundary is still there at the write.
+			 */
+			mutex_lock(&i8042_mutex);
+			cmd_pace(port, cmd);
+			start = ktime_get();
+			cmd->status = cmd_execute(port, cmd);
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+			mutex_unlock(&i8042_mutex);
+
+			spin_lock_irqsave(&i8042_lock, flags);
+			port->cmd = NULL;
+			port->cmd_ack = 0;
+			port->stats.cmds++;
+			port->stats.cmd_lat_sum_ns += ns;
+			port->stats.cmd_lat_max_ns = max(port->stats.cmd_lat_max_ns, ns);
+			port->stats.cmd_hist[min_t(int, fls64(ns >> 10), I8042_HIST_SIZE - 1)]++;
+			if (cmd->status)
+				port->stats.cmd_errors++;
+			spin_unlock_irqrestore(&i8042_lock, flags);
+			cmd->done(cmd);
+		}
+	} while (more);
+}
+
+static DECLARE_WORK(cmd_work, cmd_work_fn);
+
+/* Queues command for device on port, cmd->done is called when it is finished */
+static int i8042_queue_cmd(struct i8042_port *port, struct i8042_cmd *cmd)
+{
+	unsigned long flags;
+
+	if (cmd->nbytes < 1 || cmd->nbytes > I8042_CMD_MAX || cmd->nresp < 0 || cmd->nresp > I8042_CMD_MAX)
+		return -EINVAL;
+	cmd->status = -EINPROGRESS;
+	spin_lock_irqsave(&i8042_lock, flags);
+	if (!port->dev) {
+		spin_unlock_irqrestore(&i8042_lock, flags);
+		return -ENODEV;
+	}
+	list_add_tail(&cmd->node, &port->cmd_queue);
+	spin_unlock_irqrestore(&i8042_lock, flags);
+	schedule_work(&cmd_work);
+	return 0;
+}
+
+static void cmd_wake(struct i8042_cmd *cmd)
+{
+	complete(cmd->context);
+}
+
+/* Sends command through command engine and waits for its result */
+static int i8042_command(struct i8042_port *port, const uint8_t *bytes, int nbytes,
+			 uint8_t *resp, int nresp)
+{
+	int error;
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct i8042_cmd cmd = { .nbytes = nbytes, .nresp = nresp, .done = cmd_wake, .context = &done };
+
+	if (nbytes > I8042_CMD_MAX)
+		return -EINVAL;
+	memcpy(cmd.bytes, bytes, nbytes);
+	error = i8042_queue_cmd(port, &cmd);
+	if (error)
+		return error;
+	wait_for_completion(&done);
+	if (resp)
+		memcpy(resp, cmd.resp, nresp);
+	return cmd.status;
+}
+
+/* Sends latest LED state, changes made meanwhile requeue the work */
+static void led_work_fn(struct work_struct *work)
+{
+	uint8_t bytes[2];
+	struct i8042_port *port = container_of(work, struct i8042_port, led_work);
+
+	bytes[0] = I8042_CAPSLOCK;
+	bytes[1] = READ_ONCE(port->leds);
+	if (i8042_command(port, bytes, 2, NULL, 0))
+		printk(KERN_WARNING "i8042: can't set LEDs on %s port\n", port->name);
+}
+
+/* Input core calls this with its event lock held, so command is sent from work */
+static int kbd_event(struct input_dev *dev, unsigned int type, unsigned int code, int value)
+{
+	struct i8042_port *port = input_get_drvdata(dev);
+
+	if (type != EV_LED)
+		return -1;
+	WRITE_ONCE(port->leds, (test_bit(LED_SCROLLL, dev->led) ? 0x01 : 0) |
+			       (test_bit(LED_NUML, dev->led) ? 0x02 : 0) |
+			       (test_bit(LED_CAPSL, dev->led) ? 0x04 : 0));
+	schedule_work(&port->led_work);
+	return 0;
+}
+
+/*
+ * Queues command for device on port 1 or 2, may be called from any context.
+ * Command is serialised with driver's own commands, cmd->done is called
+ * from process context when it is finished and cmd->status is set.
+ */
+int i8042_submit_command(int port, struct i8042_cmd *cmd)
+{
+	if (port < 1 || port > ARRAY_SIZE(ports) || !cmd->done)
+		return -EINVAL;
+	return i8042_queue_cmd(&ports[port - 1], cmd);
+}
+EXPORT_SYMBOL_GPL(i8042_submit_command);
+
+/* Returns type of registered device on port 1 or 2 */
+int i8042_port_type(int port)
+{
+	if (port < 1 || port > ARRAY_SIZE(ports) || !READ_ONCE(ports[port - 1].dev))
+		return I8042_PORT_NONE;
+	return ports[port - 1].type;
+}
+EXPORT_SYMBOL_GPL(i8042_port_type);
+
+/* Sends profile settings to device on port */
+static void apply_port_profile(struct i8042_port *port)
+{
+	uint8_t bytes[2];
+
+	if (!port->dev)
+		return;
+	if (port->type == KEYBOARD) {
+		bytes[0] = I8042_SET_RATE;
+		bytes[1] = profile->typematic;
+		if (i8042_command(port, bytes, 2, NULL, 0))
+			printk(KERN_WARNING "i8042: can't set typematic on %s port\n", port->name);
+		if (soft_repeat) {
+			input_enable_softrepeat(port->dev, 250, 33);
+			__set_bit(EV_REP, port->dev->evbit);
+		} else {
+			__clear_bit(EV_REP, port->dev->evbit);
+		}
+	} else {
+		bytes[0] = I8042_SET_RATE;
+		bytes[1] = profile->mouse_rate;
+		if (i8042_command(port, bytes, 2, NULL, 0)) {
+			printk(KERN_WARNING "i8042: can't set sample rate on %s port\n", port->name);
+		} else {
+			port->rate = profile->mouse_rate;
+			WRITE_ONCE(port->clock.reset, 1);
+		}
+		bytes[0] = I8042_SET_RESOLUTION;
+		bytes[1] = profile->mouse_resolution;
+		if (i8042_command(port, bytes, 2, NULL, 0))
+			printk(KERN_WARNING "i8042: can't set resolution on %s port\n", port->name);
+	}
+}
+
+static int profile_param_set(const char *val, const struct kernel_param *kp)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(profiles); i++)
+		if (sysfs_streq(val, profiles[i].name))
+			break;
+	if (i == ARRAY_SIZE(profiles))
+		return -EINVAL;
+
+	mutex_lock(&profile_mutex);
+	profile = &profiles[i];
+	profile_set = 1;
+	mouse_budget = profile->mouse_budget;
+	poll_period = profile->poll_period;
+	instrument = profile->instrument;
+	soft_repeat = profile->soft_repeat;
+	qos_window = profile->qos_window;
+	for (i = 0; i < ARRAY_SIZE(ports); i++)
+		apply_port_profile(&ports[i]);
+	mutex_unlock(&profile_mutex);
+	return 0;
+}
+
+static int profile_param_get(char *buf, const struct kernel_param *kp)
+{
+	return scnprintf(buf, PAGE_SIZE, "%s\n", profile->name);
+}
+
+static const struct kernel_param_ops profile_param_ops = {
+	.set = profile_param_set,
+	.get = profile_param_get,
+};
+module_param_cb(profile, &profile_param_ops, NULL, 0644);
+MODULE_PARM_DESC(profile, "Performance profile (latency, balanced, power)");
+
+static int settings_param_get(char *buf, const struct kernel_param *kp)
+{
+	return scnprintf(buf, PAGE_SIZE,
+			 "profile=%s mouse_rate=%u mouse_resolution=%u typematic=0x%02x soft_repeat=%d "
+			 "mouse_budget=%u poll_period=%u instrument=%d qos_window=%u\n",
+			 profile->name, profile->mouse_rate, profile->mouse_resolution,
+			 profile->typematic, soft_repeat, mouse_budget, poll_period, instrument,
+			 qos_window);
+}
+
+static const struct kernel_param_ops settings_param_ops = {
+	.get = settings_param_get,
+};
+module_param_cb(settings, &settings_param_ops, NULL, 0444);
+MODULE_PARM_DESC(settings, "Effective settings");
+
+/* Sets and clears bits of controller config byte, i8042_mutex must be held */
+static int update_config(uint8_t set, uint8_t clear)
+{
+	int i, error = 0, stopped = 0;
+	uint8_t byte;
+
+	lockdep_assert_held(&i8042_mutex);
+	/* Config byte must not be taken by irq handler or poll timer */
+	if (poll_timer_on)
+		stopped = timer_delete_sync(&poll_timer);
+	for (i = 0; i < ARRAY_SIZE(ports); i++)
+		if (ports[i].irq_on)
+			disable_irq(ports[i].irq);
+	outb(I8042_READ_CONFIG_BYTE, I8042_COMMAND_REG);
+	if (read_reg(&byte, cmd_timeout) < 0) {
+		error = -1;
+	} else {
+		byte = (byte | set) & ~clear;
+		outb(I8042_WRITE_CONFIG_BYTE, I8042_COMMAND_REG);
+		error = write_dev1(byte, cmd_timeout);
+		config_byte = byte;
+	}
+	for (i = 0; i < ARRAY_SIZE(ports); i++)
+		if (ports[i].irq_on)
+			enable_irq(ports[i].irq);
+	/* Only timer stopped here is restarted, exit may have shut it down */
+	if (stopped)
+		mod_timer(&poll_timer, jiffies + msecs_to_jiffies(poll_period));
+	return error;
+}
+
+/* Applies platform quirks */
+static void apply_quirks(void)
+{
+	const struct dmi_system_id *dmi;
+
+	dmi = dmi_first_match(i8042_dmi_quirks);
+	if (dmi) {
+		quirks |= (unsigned long) dmi->driver_data;
+		printk(KERN_INFO "i8042: %s quirks applied\n", dmi->ident);
+	}
+	if (quirks & I8042_QUIRK_LONGBAT)
+		bat_timeout = 1000;
+	if (quirks & I8042_QUIRK_POLL)
+		printk(KERN_INFO "i8042: using polling mode\n");
+}
+
+/* Tests controller and its ports */
+static int probe_controller(void)
+{
+	uint8_t byte, dual_channel_test;
+
+	/* This code disables PS/2 ports */
+	outb(I8042_DISABLE_FIRST_PS2_PORT, I8042_COMMAND_REG);
+	outb(I8042_DISABLE_SECOND_PS2_PORT, I8042_COMMAND_REG);
+
+	/* This code flushes output buffer */
+	if (flush_output() < 0) {
+		printk(KERN_ERR "i8042: can't flush output buffer\n");
+		return -EIO;
+	}
+
+	/* This code sets config byte */
+	outb(I8042_READ_CONFIG_BYTE, I8042_COMMAND_REG);
+	if (read_reg(&byte, cmd_timeout) < 0) {
 		printk(KERN_ERR "i8042: time limit exceeded\n");
 		return -ETIME;
 	}
-	outb(I8042_WRITE_CONFIG_BYTE, I8042_COMMAND_REG);
 	dual_channel_test = test_bit(5, (void *) &byte) ? 1 : 0;
-
-	/* This code performs i8042 self check */
-	outb(I8042_SELF_TEST, I8042_COMMAND_REG);
-	if (read_reg(&byte, 250) < 0) {
+	if (quirks & I8042_QUIRK_NOAUX)
+		dual_channel_test = 0;
+	__clear_bit(0, (void *) &byte);
+	__clear_bit(1, (void *) &byte);
+	__clear_bit(6, (void *) &byte);
+	outb(I8042_WRITE_CONFIG_BYTE, I8042_COMMAND_REG);
+	if (write_dev1(byte, cmd_timeout) < 0) {
 		printk(KERN_ERR "i8042: time limit exceeded\n");
 		return -ETIME;
 	}
-	if (byte == 0x55) {
-		printk(KERN_INFO "i8042: self test was successful\n");
-	} else {
-		printk(KERN_ERR "i8042: self test failed\n");
-		return -EINVAL;
+
+	/* This code performs i8042 self check */
+	if (!(quirks & I8042_QUIRK_NOSELFTEST)) {
+		outb(I8042_SELF_TEST, I8042_COMMAND_REG);
+		if (read_reg(&byte, cmd_timeout) < 0) {
+			printk(KERN_ERR "i8042: time limit exceeded\n");
+			return -ETIME;
+		}
+		if (byte == 0x55) {
+			printk(KERN_INFO "i8042: self test was successful\n");
+		} else {
+			printk(KERN_ERR "i8042: self test failed\n");
+			return -EINVAL;
+		}
 	}
 
 	/* This code determines if there are 2 channels */
 	if (dual_channel_test) {
 		outb(I8042_ENABLE_SECOND_PS2_PORT, I8042_COMMAND_REG);
 		outb(I8042_READ_CONFIG_BYTE, I8042_COMMAND_REG);
-		if (read_reg(&byte, 250) < 0) {
+		if (read_reg(&byte, cmd_timeout) < 0) {
 			printk(KERN_ERR "i8042: time limit exceeded\n");
 			return -ETIME;
 		}
@@ -264,322 +1596,1055 @@ int init_module(void)
 	}
 
 	/* This code performs interface check */
-	outb(I8042_FIRST_PORT_INTERFACE_TEST, I8042_COMMAND_REG);
-	if (read_reg(&byte, 250) < 0) {
-		printk(KERN_ERR "i8042: time limit exceeded\n");
-		return -ETIME;
-	}
-	if (byte == 0x00) {
-		first_port = 1;
-		printk(KERN_INFO "i8042: test of first port was successful\n");
+	if (quirks & I8042_QUIRK_NOPORTTEST) {
+		ports[0].present = 1;
+		ports[1].present = dual_channel_test;
 	} else {
-		printk(KERN_ERR "i8042: test of first port failed\n");
-	}
-	if (dual_channel_test) {
-		outb(I8042_SECOND_PORT_INTERFACE_TEST, I8042_COMMAND_REG);
-		if (read_reg(&byte, 250) < 0) {
+		outb(I8042_FIRST_PORT_INTERFACE_TEST, I8042_COMMAND_REG);
+		if (read_reg(&byte, cmd_timeout) < 0) {
 			printk(KERN_ERR "i8042: time limit exceeded\n");
 			return -ETIME;
 		}
 		if (byte == 0x00) {
-			second_port = 1;
-			printk(KERN_INFO "i8042: test of second port was successful\n");
+			ports[0].present = 1;
+			printk(KERN_INFO "i8042: test of first port was successful\n");
 		} else {
-			printk(KERN_ERR "i8042: test of second port failed\n");
+			printk(KERN_ERR "i8042: test of first port failed\n");
+		}
+		if (dual_channel_test) {
+			outb(I8042_SECOND_PORT_INTERFACE_TEST, I8042_COMMAND_REG);
+			if (read_reg(&byte, cmd_timeout) < 0) {
+				printk(KERN_ERR "i8042: time limit exceeded\n");
+				return -ETIME;
+			}
+			if (byte == 0x00) {
+				ports[1].present = 1;
+				printk(KERN_INFO "i8042: test of second port was successful\n");
+			} else {
+				printk(KERN_ERR "i8042: test of second port failed\n");
+			}
 		}
 	}
-	if (!first_port && !second_port) {
+	if (!ports[0].present && !ports[1].present) {
 		return -EINVAL;
 	}
 
-	/* This code enables ports */
-	outb(I8042_READ_CONFIG_BYTE, I8042_COMMAND_REG);
-	if (read_reg(&byte, 250) < 0) {
+	/* This code enables ports, interrupts are enabled when port is registered */
+	if (ports[0].present)
+		outb(I8042_ENABLE_FIRST_PS2_PORT, I8042_COMMAND_REG);
+	if (ports[1].present)
+		outb(I8042_ENABLE_SECOND_PS2_PORT, I8042_COMMAND_REG);
+	if (update_config(BIT(6), 0) < 0) {
 		printk(KERN_ERR "i8042: time limit exceeded\n");
 		return -ETIME;
 	}
-	if (first_port) {
-		outb(I8042_ENABLE_FIRST_PS2_PORT, I8042_COMMAND_REG);
-		__set_bit(0, (void *) &byte);
+	return 0;
+}
+
+/* Executes command while i8042_mutex is held, so command work can't run */
+static int cmd_execute_locked(struct i8042_port *port, uint8_t byte0, uint8_t byte1, int nbytes)
+{
+	int error;
+	unsigned long flags;
+	struct i8042_cmd cmd = { .bytes = { byte0, byte1 }, .nbytes = nbytes };
+
+	lockdep_assert_held(&i8042_mutex);
+	error = cmd_execute(port, &cmd);
+	spin_lock_irqsave(&i8042_lock, flags);
+	port->cmd = NULL;
+	port->cmd_ack = 0;
+	spin_unlock_irqrestore(&i8042_lock, flags);
+	return error;
+}
+
+/* Keyboard disable also restores defaults, so settings differing from them are sent again */
+static void loopback_restore(struct i8042_port *port)
+{
+	if (cmd_execute_locked(port, I8042_KBD_ENABLE, 0, 1))
+		printk(KERN_WARNING "i8042: can't enable device on %s port after loopback\n", port->name);
+	if (port->type != KEYBOARD)
+		return;
+	if (port->decode == decode_set3)
+		cmd_execute_locked(port, I8042_SET_ALL_MBR, 0, 1);
+	if (profile_set)
+		cmd_execute_locked(port, I8042_SET_RATE, READ_ONCE(profile)->typematic, 2);
+}
+
+/* Injects count bytes through controller, returns number of delivered bytes, i8042_mutex must be held */
+static int loopback_run(struct i8042_port *port, unsigned int count, int quiet)
+{
+	unsigned int i;
+	uint8_t cmd;
+
+	lockdep_assert_held(&i8042_mutex);
+	cmd = port->num == 1 ? I8042_WRITE_FIRST_PS2_OUTPUT_BUFFER : I8042_WRITE_SECOND_PS2_OUTPUT_BUFFER;
+	mutex_lock(&loopback.mutex);
+	loopback.count = loopback.timeouts = loopback.mismatches = 0;
+	loopback.write_irq_min = S64_MAX;
+	loopback.write_irq_max = loopback.write_irq_sum = 0;
+	loopback.irq_evdev_max = loopback.irq_evdev_sum = 0;
+	loopback.port = port->num;
+	/*
+	 * Device is quiet during benchmark, so keys and acknowledges are not taken as
+	 * injected bytes. Routing check in probe skips it, its acknowledges would need
+	 * the irq being checked.
+	 */
+	if (quiet && cmd_execute_locked(port, I8042_KBD_DISABLE, 0, 1))
+		printk(KERN_WARNING "i8042: can't disable device on %s port for loopback\n", port->name);
+	WRITE_ONCE(loopback.running, port->num);
+	for (i = 0; i < count; i++) {
+		reinit_completion(&loopback.done);
+		/* Prefix and response bytes are avoided */
+		loopback.expected = 0x10 + i % 0x40;
+		outb(cmd, I8042_COMMAND_REG);
+		loopback.sent = ktime_get();
+		WRITE_ONCE(loopback.active, 1);
+		if (write_dev1(loopback.expected, cmd_timeout) < 0 ||
+		    !wait_for_completion_timeout(&loopback.done, msecs_to_jiffies(I8042_LOOPBACK_WAIT))) {
+			WRITE_ONCE(loopback.active, 0);
+			loopback.timeouts++;
+			break;
+		}
+		loopback.count++;
+		loopback.write_irq_sum += loopback.write_irq_ns;
+		loopback.write_irq_min = min(loopback.write_irq_min, loopback.write_irq_ns);
+		loopback.write_irq_max = max(loopback.write_irq_max, loopback.write_irq_ns);
+		loopback.irq_evdev_sum += loopback.irq_evdev_ns;
+		loopback.irq_evdev_max = max(loopback.irq_evdev_max, loopback.irq_evdev_ns);
 	}
-	if (second_port) {
-		outb(I8042_ENABLE_SECOND_PS2_PORT, I8042_COMMAND_REG);
-		__set_bit(1, (void *) &byte);
+	/* Late injected byte is dropped by loopback_receive, not decoded as key */
+	if (loopback.timeouts)
+		msleep(I8042_LOOPBACK_WAIT);
+	WRITE_ONCE(loopback.running, 0);
+	if (quiet)
+		loopback_restore(port);
+	mutex_unlock(&loopback.mutex);
+	return loopback.count;
+}
+
+/* Metrics are exported through sysfs and netlink, debugfs may be locked down */
+static void stats_snapshot(struct i8042_port *port, struct i8042_stats *st)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&i8042_lock, flags);
+	*st = port->stats;
+	spin_unlock_irqrestore(&i8042_lock, flags);
+}
+
+static struct i8042_port *dev_to_port(struct device *d)
+{
+	return input_get_drvdata(to_input_dev(d));
+}
+
+static ssize_t events_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return sysfs_emit(buf, "%llu\n", st.events);
+}
+static DEVICE_ATTR_RO(events);
+
+static ssize_t overflows_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return sysfs_emit(buf, "%u\n", st.overflows);
+}
+static DEVICE_ATTR_RO(overflows);
+
+static ssize_t latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return sysfs_emit(buf, "%llu %llu\n",
+			  st.events ? div64_u64(st.lat_sum_ns, st.events) : 0, st.lat_max_ns);
+}
+static DEVICE_ATTR_RO(latency);
+
+static ssize_t hist_emit(char *buf, const u32 *hist)
+{
+	int i, len = 0;
+
+	for (i = 0; i < I8042_HIST_SIZE; i++)
+		len += sysfs_emit_at(buf, len, "%u%c", hist[i], i == I8042_HIST_SIZE - 1 ? '\n' : ' ');
+	return len;
+}
+
+static ssize_t latency_hist_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return hist_emit(buf, st.lat_hist);
+}
+static DEVICE_ATTR_RO(latency_hist);
+
+static ssize_t commands_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return sysfs_emit(buf, "%llu %u\n", st.cmds, st.cmd_errors);
+}
+static DEVICE_ATTR_RO(commands);
+
+static ssize_t command_latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return sysfs_emit(buf, "%llu %llu\n",
+			  st.cmds ? div64_u64(st.cmd_lat_sum_ns, st.cmds) : 0, st.cmd_lat_max_ns);
+}
+static DEVICE_ATTR_RO(command_latency);
+
+static ssize_t command_hist_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return hist_emit(buf, st.cmd_hist);
+}
+static DEVICE_ATTR_RO(command_hist);
+
+static ssize_t command_pacing_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_stats st;
+
+	stats_snapshot(dev_to_port(d), &st);
+	return sysfs_emit(buf, "%u %u %u\n", st.cmd_deferred, st.cmd_avoided, st.cmd_forced);
+}
+static DEVICE_ATTR_RO(command_pacing);
+
+static ssize_t scancode_set_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%d\n", dev_to_port(d)->set);
+}
+static DEVICE_ATTR_RO(scancode_set);
+
+static ssize_t decoder_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct i8042_port *port = dev_to_port(d);
+
+	return sysfs_emit(buf, "%s\n", port->type == KEYBOARD ? port->decoder : "mouse");
+}
+static DEVICE_ATTR_RO(decoder);
+
+static struct attribute *stats_attrs[] = {
+	&dev_attr_events.attr,
+	&dev_attr_overflows.attr,
+	&dev_attr_latency.attr,
+	&dev_attr_latency_hist.attr,
+	&dev_attr_commands.attr,
+	&dev_attr_command_latency.attr,
+	&dev_attr_command_hist.attr,
+	&dev_attr_command_pacing.attr,
+	&dev_attr_scancode_set.attr,
+	&dev_attr_decoder.attr,
+	NULL
+};
+
+static const struct attribute_group stats_group = {
+	.name = "i8042",
+	.attrs = stats_attrs,
+};
+
+/* Group is created by device core before add uevent, so udev sees it */
+static const struct attribute_group *stats_groups[] = {
+	&stats_group,
+	NULL,
+};
+
+/* Multicast period in milliseconds, off by default so idle CPU is not woken */
+static unsigned int netlink_interval;
+module_param(netlink_interval, uint, 0444);
+MODULE_PARM_DESC(netlink_interval, "Period of metrics multicast in ms, 0 disables it");
+
+static struct genl_family i8042_genl_family;
+
+static int stats_fill(struct sk_buff *skb, struct i8042_port *port, u32 portid, u32 seq, int flags)
+{
+	void *hdr;
+	struct i8042_stats st;
+
+	hdr = genlmsg_put(skb, portid, seq, &i8042_genl_family, flags, I8042_GENL_CMD_GET_STATS);
+	if (!hdr)
+		return -EMSGSIZE;
+	stats_snapshot(port, &st);
+	if (nla_put_u8(skb, I8042_GENL_ATTR_PORT, port->num) ||
+	    nla_put_u8(skb, I8042_GENL_ATTR_TYPE, port->type) ||
+	    nla_put_u64_64bit(skb, I8042_GENL_ATTR_EVENTS, st.events, I8042_GENL_ATTR_PAD) ||
+	    nla_put_u32(skb, I8042_GENL_ATTR_OVERFLOWS, st.overflows) ||
+	    nla_put_u64_64bit(skb, I8042_GENL_ATTR_LAT_SUM_NS, st.lat_sum_ns, I8042_GENL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, I8042_GENL_ATTR_LAT_MAX_NS, st.lat_max_ns, I8042_GENL_ATTR_PAD) ||
+	    nla_put(skb, I8042_GENL_ATTR_LAT_HIST, sizeof(st.lat_hist), st.lat_hist) ||
+	    nla_put_u64_64bit(skb, I8042_GENL_ATTR_CMDS, st.cmds, I8042_GENL_ATTR_PAD) ||
+	    nla_put_u32(skb, I8042_GENL_ATTR_CMD_ERRORS, st.cmd_errors) ||
+	    nla_put_u64_64bit(skb, I8042_GENL_ATTR_CMD_SUM_NS, st.cmd_lat_sum_ns, I8042_GENL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, I8042_GENL_ATTR_CMD_MAX_NS, st.cmd_lat_max_ns, I8042_GENL_ATTR_PAD) ||
+	    nla_put(skb, I8042_GENL_ATTR_CMD_HIST, sizeof(st.cmd_hist), st.cmd_hist)) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
 	}
-	__set_bit(6, (void *) &byte);
-	outb(byte, I8042_DATA_REG);
-	outb(I8042_WRITE_CONFIG_BYTE, I8042_COMMAND_REG);
+	genlmsg_end(skb, hdr);
+	return 0;
+}
 
-	/* This code resets devices */
-	if (write_dev1(I8042_RESET, 250) < 0) {
-		printk(KERN_ERR "i8042: time limit exceeded\n");
-		return -ETIME;
+static int i8042_genl_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	int i;
+
+	for (i = cb->args[0]; i < ARRAY_SIZE(ports); i++) {
+		if (!READ_ONCE(ports[i].dev))
+			continue;
+		if (stats_fill(skb, &ports[i], NETLINK_CB(cb->skb).portid,
+			       cb->nlh->nlmsg_seq, NLM_F_MULTI) < 0)
+			break;
 	}
-	if (read_reg(&byte, 250) < 0) {
-		printk(KERN_ERR "i8042: time limit exceeded 1\n");
+	cb->args[0] = i;
+	return skb->len;
+}
+
+static const struct genl_small_ops i8042_genl_ops[] = {
+	{
+		.cmd = I8042_GENL_CMD_GET_STATS,
+		.dumpit = i8042_genl_dump,
+	},
+};
+
+static const struct genl_multicast_group i8042_genl_mcgrps[] = {
+	{ .name = I8042_GENL_MCGRP_NAME },
+};
+
+static struct genl_family i8042_genl_family = {
+	.name = I8042_GENL_NAME,
+	.version = I8042_GENL_VERSION,
+	/* Only command is dump without attributes, so there is no policy */
+	.maxattr = 0,
+	.module = THIS_MODULE,
+	.small_ops = i8042_genl_ops,
+	.n_small_ops = ARRAY_SIZE(i8042_genl_ops),
+	.mcgrps = i8042_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(i8042_genl_mcgrps),
+};
+static int genl_registered;
+
+/* Sends metrics of all ports to multicast group while somebody listens */
+static void genl_notify_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(genl_notify_work, genl_notify_fn);
+
+static void genl_notify_fn(struct work_struct *work)
+{
+	int i;
+	struct sk_buff *skb;
+
+	if (genl_has_listeners(&i8042_genl_family, &init_net, 0)) {
+		for (i = 0; i < ARRAY_SIZE(ports); i++) {
+			if (!READ_ONCE(ports[i].dev))
+				continue;
+			skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+			if (!skb)
+				break;
+			if (stats_fill(skb, &ports[i], 0, 0, 0) < 0) {
+				nlmsg_free(skb);
+				continue;
+			}
+			genlmsg_multicast(&i8042_genl_family, skb, 0, 0, GFP_KERNEL);
+		}
+	}
+	schedule_delayed_work(&genl_notify_work, msecs_to_jiffies(netlink_interval));
+}
+
+/* Restores state probed by previous kernel, returns 0 if devices are still there */
+static int restore_handover(void)
+{
+	int i;
+	uint8_t byte;
+	struct i8042_port *port;
+
+	outb(I8042_DISABLE_FIRST_PS2_PORT, I8042_COMMAND_REG);
+	outb(I8042_DISABLE_SECOND_PS2_PORT, I8042_COMMAND_REG);
+	if (flush_output() < 0)
+		return -EIO;
+	outb(I8042_WRITE_CONFIG_BYTE, I8042_COMMAND_REG);
+	if (write_dev1(handover.config & ~(BIT(0) | BIT(1)), cmd_timeout) < 0)
 		return -ETIME;
+	config_byte = handover.config & ~(BIT(0) | BIT(1));
+
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		port = &ports[i];
+		if (handover.port[i].type == UNDEFINED)
+			continue;
+		outb(i == 0 ? I8042_ENABLE_FIRST_PS2_PORT : I8042_ENABLE_SECOND_PS2_PORT,
+		     I8042_COMMAND_REG);
+
+		/* Single echo shows keyboard is still there, mice answer identify instead */
+		if (handover.port[i].type == KEYBOARD) {
+			if (write_dev(port->num, I8042_ECHO, cmd_timeout) < 0 ||
+			    read_reg(&byte, cmd_timeout) < 0 || byte != I8042_ECHO_RESPONSE)
+				return -ENODEV;
+		} else {
+			if (command_dev(port->num, I8042_IDENTIFY) < 0 ||
+			    read_reg(&byte, cmd_timeout) < 0 || byte != handover.port[i].id)
+				return -ENODEV;
+		}
+		port->present = 1;
+		port->type = handover.port[i].type;
+		port->id = handover.port[i].id;
+		port->id2 = handover.port[i].id2;
+		port->rate = handover.port[i].rate;
+		port->set = handover.port[i].set;
+	}
+	return 0;
+}
+
+static int topology_param_set(const char *val, const struct kernel_param *kp)
+{
+	int t1, t2;
+	unsigned int r1, r2;
+	struct i8042_handover h = { };
+
+	if (sscanf(val, "v1:%hhx:%d:%hhx:%hhx:%hhx:%u:%d:%hhx:%hhx:%hhx:%u", &h.config,
+		   &t1, &h.port[0].id, &h.port[0].id2, &h.port[0].set, &r1,
+		   &t2, &h.port[1].id, &h.port[1].id2, &h.port[1].set, &r2) != 11)
+		return -EINVAL;
+	if (t1 < UNDEFINED || t1 > MOUSE || t2 < UNDEFINED || t2 > MOUSE)
+		return -EINVAL;
+	/* Set is trusted by decoder binding and rate by clock tracker */
+	if (h.port[0].set > 3 || h.port[1].set > 3 || r1 > 200 || r2 > 200 ||
+	    (t1 == MOUSE && !r1) || (t2 == MOUSE && !r2))
+		return -EINVAL;
+	h.port[0].type = t1;
+	h.port[0].rate = r1;
+	h.port[1].type = t2;
+	h.port[1].rate = r2;
+	h.valid = 1;
+	handover = h;
+	return 0;
+}
+
+static int topology_param_get(char *buf, const struct kernel_param *kp)
+{
+	struct i8042_port *p1 = &ports[0], *p2 = &ports[1];
+
+	return scnprintf(buf, PAGE_SIZE, "v1:%02x:%d:%02x:%02x:%02x:%u:%d:%02x:%02x:%02x:%u\n",
+			 config_byte,
+			 p1->dev ? p1->type : UNDEFINED, p1->id, p1->id2, p1->set, p1->rate,
+			 p2->dev ? p2->type : UNDEFINED, p2->id, p2->id2, p2->set, p2->rate);
+}
+
+static const struct kernel_param_ops topology_param_ops = {
+	.set = topology_param_set,
+	.get = topology_param_get,
+};
+/*
+ * Usage on kexec:
+ *	kexec -l ... --append="$(cat /proc/cmdline) \
+ *		i8042_driver.topology=$(cat /sys/module/i8042_driver/parameters/topology)"
+ */
+module_param_cb(topology, &topology_param_ops, NULL, 0444);
+MODULE_PARM_DESC(topology, "Probed topology, passed to next kernel to skip probing");
+
+/* Queries scan code set of keyboard, returns 1..3 or 0 if it is unknown */
+static int query_set(struct i8042_port *port)
+{
+	uint8_t byte;
+
+	if (command_dev(port->num, I8042_SCANCODE_SET) < 0 || command_dev(port->num, 0x00) < 0)
+		return 0;
+	if (read_reg(&byte, cmd_timeout) < 0)
+		return 0;
+	/* Reply is translated on first port */
+	if (byte == 0x01 || byte == 0x43)
+		return 1;
+	if (byte == 0x02 || byte == 0x41)
+		return 2;
+	if (byte == 0x03 || byte == 0x3F)
+		return 3;
+	return 0;
+}
+
+/* Binds decoder to scan code set, so no set checks are done per byte */
+static void bind_decoder(struct i8042_port *port)
+{
+	int translated = port->num == 1 && (config_byte & BIT(6));
+
+	if (!port->set)
+		port->set = query_set(port);
+	/* Controller translates set 2 only */
+	if (translated && port->set != 2) {
+		if (command_dev(port->num, I8042_SCANCODE_SET) == 0 && command_dev(port->num, 2) == 0)
+			port->set = 2;
+	}
+
+	if (translated || port->set == 1) {
+		port->decode = decode_set1;
+		port->decoder = translated ? "set1 (translated)" : "set1";
+	} else if (port->set == 3) {
+		/* Set 3 keys send only make codes by default */
+		if (command_dev(port->num, I8042_SET_ALL_MBR) < 0)
+			printk(KERN_WARNING "i8042: can't enable break codes on %s port\n", port->name);
+		port->decode = decode_set3;
+		port->decoder = "set3";
+	} else {
+		port->decode = decode_set2;
+		port->decoder = "set2";
+	}
+	printk(KERN_INFO "i8042: scan code set %d on %s port, %s decoder\n",
+	       port->set, port->name, port->decoder);
+}
+
+/* Detects the device on port and registers it in input subsystem */
+static int attach_port(struct i8042_port *port)
+{
+	int error;
+	unsigned long flags;
+	struct input_dev *dev;
+
+	/* Type is already known after handover */
+	if (!port->type)
+		port->type = detect_dev(port);
+	/* Drops responses left by failed or partial detection */
+	if (flush_output() < 0)
+		printk(KERN_WARNING "i8042: can't flush output buffer\n");
+	if (!port->type) {
+		printk(KERN_INFO "i8042: can't detect device on %s port\n", port->name);
+		outb(port->num == 1 ? I8042_DISABLE_FIRST_PS2_PORT : I8042_DISABLE_SECOND_PS2_PORT,
+		     I8042_COMMAND_REG);
+		return -ENODEV;
+	}
+
+	dev = input_allocate_device();
+	if (!dev) {
+		printk(KERN_ERR "i8042: can't allocate enough memory\n");
+		error = -ENOMEM;
+		goto err_undefined;
 	}
-	if (write_dev2(I8042_RESET, 250) < 0) {
+
+	dev->name = port->dev_name;
+	dev->dev.groups = stats_groups;
+	input_set_drvdata(dev, port);
+	__set_bit(EV_KEY, dev->evbit);
+	__set_bit(EV_MSC, dev->evbit);
+	__set_bit(MSC_RAW, dev->mscbit);
+	if (port->type == KEYBOARD) {
+		bitmap_fill(dev->keybit, KEY_CNT);
+		__set_bit(EV_LED, dev->evbit);
+		__set_bit(LED_NUML, dev->ledbit);
+		__set_bit(LED_CAPSL, dev->ledbit);
+		__set_bit(LED_SCROLLL, dev->ledbit);
+		dev->event = kbd_event;
+		port->leds = 0;
+	} else {
+		__set_bit(EV_REL, dev->evbit);
+		__set_bit(MSC_TIMESTAMP, dev->mscbit);
+		__set_bit(REL_X, dev->relbit);
+		__set_bit(REL_Y, dev->relbit);
+		__set_bit(BTN_LEFT, dev->keybit);
+		__set_bit(BTN_RIGHT, dev->keybit);
+		__set_bit(BTN_MIDDLE, dev->keybit);
+		if (port->id == 0x03 || port->id == 0x04)
+			__set_bit(REL_WHEEL, dev->relbit);
+		if (port->id == 0x04) {
+			__set_bit(BTN_SIDE, dev->keybit);
+			__set_bit(BTN_EXTRA, dev->keybit);
+		}
+	}
+	if (port->type == KEYBOARD)
+		bind_decoder(port);
+	port->packet_size = port->id == 0x03 || port->id == 0x04 ? 4 : 3;
+	port->packet_len = 0;
+	/* Set defaults and reset leave mouse at 100 samples per second */
+	if (!port->rate)
+		port->rate = 100;
+	port->clock.reset = 1;
+	port->e0 = port->f0 = 0;
+	port->head = port->tail = 0;
+
+	if ((error = input_register_device(dev))) {
+		printk(KERN_ERR "i8042: can't register %s\n", port->dev_name);
+		input_free_device(dev);
+		goto err_undefined;
+	}
+
+	/* Device is enabled before it is published, so acknowledge is not drained */
+	if (command_dev(port->num, I8042_KBD_ENABLE) < 0) {
 		printk(KERN_ERR "i8042: time limit exceeded\n");
-		return -ETIME;
+		error = -ETIME;
+		goto err_unreg;
+	}
+	spin_lock_irqsave(&i8042_lock, flags);
+	port->dev = dev;
+	spin_unlock_irqrestore(&i8042_lock, flags);
+	if (request_port_irq(port)) {
+		printk(KERN_ERR "i8042: can't register irq %d\n", port->irq);
+		error = -EBUSY;
+		goto err_unpublish;
 	}
-	if (read_reg(&byte, 250) < 0) {
+	if (!(quirks & I8042_QUIRK_POLL) && update_config(BIT(port->irq_bit), 0) < 0) {
 		printk(KERN_ERR "i8042: time limit exceeded\n");
-		return -ETIME;
+		error = -ETIME;
+		goto err_irq_free;
 	}
 
-	/* Detecting device on first port */
-	if (first_port) {
-		if (write_dev1(I8042_DISABLE_SCANNING, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on first port\n");
-			first_port = UNDEFINED;
-			goto first_port_fail;
-		}
-		if (read_reg(&byte, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on first port\n");
-			first_port = UNDEFINED;
-			goto first_port_fail;
-		}
-		if (write_dev1(I8042_IDENTIFY, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on first port\n");
-			first_port = UNDEFINED;
-			goto first_port_fail;
-		}
-		if (read_reg(&byte, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on first port\n");
-			first_port = UNDEFINED;
-			goto first_port_fail;
-		}
-		if (byte == 0xFA) {
-			if (read_reg(&byte, 250) < 0) {
-				printk(KERN_INFO "i8042: can't detect device on first port\n");
-				first_port = UNDEFINED;
-				goto first_port_fail;
-			}
-			if (byte == 0x00) {
-				printk(KERN_INFO "i8042: standard mouse on first port\n");
-				first_port = MOUSE;
-			} else if (byte == 0x03) {
-				printk(KERN_INFO "i8042: mouse with wheel on first port\n");
-				first_port = MOUSE;
-			} else if (byte == 0x04) {
-				printk(KERN_INFO "i8042: 5 button mouse on first port\n");
-				first_port = MOUSE;
-			} else if (byte == 0xAB) {
-				uint8_t byte2;
-				if (read_reg(&byte2, 250) < 0) {
-					printk(KERN_INFO "i8042: can't detect device on first port\n");
-					first_port = UNDEFINED;
-					goto first_port_fail;
-				}
-				if (byte == 0xAB && (byte2 == 0x41 || byte2 == 0xC1)) {
-					printk(KERN_INFO "i8042: MF2 keyboard with translation on first port\n");
-					first_port = KEYBOARD;
-				} else if (byte == 0xAB && byte2 == 0x83) {
-					printk(KERN_INFO "i8042: MF2 keyboard on first port\n");
-					first_port = KEYBOARD;
-				}
-				else {
-					printk(KERN_INFO "i8042: can't detect device on first port\n");
-					first_port = UNDEFINED;
-				}
-			} else {
-				printk(KERN_INFO "i8042: can't detect device on first port\n");
-				first_port = UNDEFINED;
-			}
-		} else {
-			printk(KERN_INFO "i8042: can't detect device on first port\n");
-			first_port = UNDEFINED;
-		}
-	}
-first_port_fail:
-
-	/* Detecting device on second port */
-	if (second_port) {
-		if (write_dev2(I8042_DISABLE_SCANNING, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on second port\n");
-			second_port = UNDEFINED;
-			goto second_port_fail;
-		}
-		if (read_reg(&byte, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on second port\n");
-			second_port = UNDEFINED;
-			goto second_port_fail;
-		}
-		if (write_dev2(I8042_IDENTIFY, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on second port\n");
-			second_port = UNDEFINED;
-			goto second_port_fail;
-		}
-		if (read_reg(&byte, 250) < 0) {
-			printk(KERN_INFO "i8042: can't detect device on second port\n");
-			second_port = UNDEFINED;
-			goto second_port_fail;
-		}
-		if (byte == 0xFA) {
-			if (read_reg(&byte, 250) < 0) {
-				printk(KERN_INFO "i8042: can't detect device on second port\n");
-				second_port = UNDEFINED;
-				goto second_port_fail;
-			}
-			if (byte == 0x00) {
-				printk(KERN_INFO "i8042: standard mouse on second port\n");
-				second_port = MOUSE;
-			} else if (byte == 0x03) {
-				printk(KERN_INFO "i8042: mouse with wheel on second port\n");
-				second_port = MOUSE;
-			} else if (byte == 0x04) {
-				printk(KERN_INFO "i8042: 5 button mouse on second port\n");
-				second_port = MOUSE;
-			} else if (byte == 0xAB) {
-				uint8_t byte2;
-				if (read_reg(&byte2, 250) < 0) {
-					printk(KERN_INFO "i8042: can't detect device on second port\n");
-					second_port = UNDEFINED;
-					goto second_port_fail;
-				}
-				if (byte2 == 0x41 || byte2 == 0xC1) {
-					printk(KERN_INFO "i8042: MF2 keyboard with translation on second port\n");
-					second_port = KEYBOARD;
-				} else {
-					printk(KERN_INFO "i8042: can't detect device on second port\n");
-					second_port = UNDEFINED;
-				}
-			} else {
-				printk(KERN_INFO "i8042: can't detect device on second port\n");
-				second_port = UNDEFINED;
-			}
-		} else {
-			printk(KERN_INFO "i8042: can't detect device on second port\n");
-			second_port = UNDEFINED;
-		}
+	/* Single injected byte shows irq routing without waiting for device */
+	if (port->irq_on && loopback_run(port, 1, 0) < 1) {
+		printk(KERN_WARNING "i8042: irq %d is not delivered, polling %s port\n",
+		       port->irq, port->name);
+		update_config(0, BIT(port->irq_bit));
+		free_port_irq(port);
+		/* Recovers from undelivered injected byte and acknowledges, they would be decoded by polling */
+		if (flush_output() < 0)
+			printk(KERN_WARNING "i8042: can't flush output buffer\n");
 	}
-second_port_fail:
+	return 0;
 
-	if (first_port) {
-		dev1 = input_allocate_device();
-		if (!dev1) {
-			printk(KERN_ERR "i8042: can't allocate enough memory\n");
-			return -ENOMEM;
-		}
+err_irq_free:
+	free_port_irq(port);
+err_unpublish:
+	spin_lock_irqsave(&i8042_lock, flags);
+	port->dev = NULL;
+	spin_unlock_irqrestore(&i8042_lock, flags);
+	tasklet_kill(&i8042_tasklet);
+err_unreg:
+	input_unregister_device(dev);
+	cancel_work_sync(&port->led_work);
+err_undefined:
+	port->type = UNDEFINED;
+	port->rate = 0;
+	port->set = 0;
+	return error;
+}
 
-		dev1->name = "i8042_dev1";
-		__set_bit(EV_KEY, dev1->evbit);
-		bitmap_fill(dev1->keybit, KEY_CNT);
+/* Sets up port, i8042_mutex must be held */
+static int setup_port(struct i8042_port *port)
+{
+	int error, quiet = port->num == 2 && ports[0].dev;
 
-		if ((error = input_register_device(dev1))) {
-			printk(KERN_ERR "i8042: can't register dev1\n");
-			goto err_dev1_free;
-		}
-		if (request_irq(I8042_IRQ1, i8042_handler, IRQF_SHARED, "i8042_dev1", dev1)) {
-			printk(KERN_ERR "i8042: can't register irq %d\n", I8042_IRQ1);
-			error = -EBUSY;
-			goto err_dev1_unreg;
-		}
+	/* Keyboard bytes must not be taken as mouse responses */
+	if (quiet)
+		outb(I8042_DISABLE_FIRST_PS2_PORT, I8042_COMMAND_REG);
+	error = attach_port(port);
+	if (quiet)
+		outb(I8042_ENABLE_FIRST_PS2_PORT, I8042_COMMAND_REG);
+	return error;
+}
 
-		if (write_dev1(I8042_KBD_ENABLE, 250) < 0) {
-			printk(KERN_ERR "i8042: time limit exceeded\n");
-			error = -ETIME;
-			goto err_irq1_free;
-		}
-		if (read_reg(&byte, 250) < 0) {
-			printk(KERN_ERR "i8042: time limit exceeded\n");
-			error = -ETIME;
-			goto err_irq1_free;
-		}
+static void release_port(struct i8042_port *port)
+{
+	unsigned long flags;
+	struct input_dev *dev = port->dev;
+
+	if (!dev)
+		return;
+	if (port->irq_on) {
+		mutex_lock(&i8042_mutex);
+		update_config(0, BIT(port->irq_bit));
+		mutex_unlock(&i8042_mutex);
 	}
+	/* Bottom half and drain skip ports without device */
+	spin_lock_irqsave(&i8042_lock, flags);
+	port->dev = NULL;
+	spin_unlock_irqrestore(&i8042_lock, flags);
+	free_port_irq(port);
+	tasklet_kill(&i8042_tasklet);
+	/* Command work fails commands queued for port without device */
+	schedule_work(&cmd_work);
+	flush_work(&cmd_work);
+	input_unregister_device(dev);
+	cancel_work_sync(&port->led_work);
+	port->type = UNDEFINED;
+	port->rate = 0;
+	port->set = 0;
+}
 
-	if (second_port) {
-		dev2 = input_allocate_device();
-		if (!dev2) {
-			printk(KERN_ERR "i8042: can't allocate enough memory\n");
-			error = -ENOMEM;
-			if (first_port)
-				goto err_irq1_free;
-			else
-				return error;
-		}
+/* Probes second port after keyboard is already usable */
+static void aux_probe_work(struct work_struct *work)
+{
+	ktime_t start = ktime_get();
 
-		dev2->name = "i8042_dev2";
-		__set_bit(EV_KEY, dev2->evbit);
-		__set_bit(BTN_0, dev2->keybit);
+	mutex_lock(&i8042_mutex);
+	setup_port(&ports[1]);
+	printk(KERN_INFO "i8042: second port probed in %lld us\n",
+	       ktime_us_delta(ktime_get(), start));
+	start_polling();
+	mutex_unlock(&i8042_mutex);
+	if (profile_set) {
+		mutex_lock(&profile_mutex);
+		apply_port_profile(&ports[1]);
+		mutex_unlock(&profile_mutex);
+	}
+}
 
-		if ((error = input_register_device(dev2))) {
-			printk(KERN_ERR "i8042: can't register dev2\n");
-			if (first_port)
-				goto err_first_dev2_free;
-			else
-				goto err_second_dev2_free;
-		}
-		if (request_irq(I8042_IRQ12, i8042_handler, IRQF_SHARED, "i8042_dev2", dev2)) {
-			printk(KERN_ERR "i8042: can't register irq %d\n", I8042_IRQ12);
-			error = -EBUSY;
-			if (first_port)
-				goto err_first_dev2_unreg;
-			else
-				goto err_second_dev2_unreg;
-		}
+static DECLARE_WORK(aux_work, aux_probe_work);
 
-		if (write_dev2(I8042_KBD_ENABLE, 250) < 0) {
-			printk(KERN_ERR "i8042: time limit exceeded\n");
-			error = -ETIME;
-			if (first_port)
-				goto err_first_irq12_free;
-			else
-				goto err_second_irq12_free;
+static int loopback_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&loopback.mutex);
+	seq_printf(m, "port: %d\n", loopback.port);
+	seq_printf(m, "delivered: %u\n", loopback.count);
+	seq_printf(m, "timeouts: %u\n", loopback.timeouts);
+	seq_printf(m, "mismatches: %u\n", loopback.mismatches);
+	if (loopback.count) {
+		seq_printf(m, "write_irq_ns: min %lld avg %lld max %lld\n",
+			   loopback.write_irq_min, div_s64(loopback.write_irq_sum, loopback.count),
+			   loopback.write_irq_max);
+		seq_printf(m, "irq_evdev_ns: avg %lld max %lld\n",
+			   div_s64(loopback.irq_evdev_sum, loopback.count), loopback.irq_evdev_max);
+	}
+	mutex_unlock(&loopback.mutex);
+	return 0;
+}
+
+static int loopback_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, loopback_show, NULL);
+}
+
+/* Accepts "<port> <count>" and runs benchmark on that port */
+static ssize_t loopback_write(struct file *file, const char __user *ubuf, size_t len, loff_t *ppos)
+{
+	char buf[32];
+	int num;
+	unsigned int count;
+
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = 0;
+	if (sscanf(buf, "%d %u", &num, &count) != 2 || num < 1 || num > 2 ||
+	    !count || count > I8042_LOOPBACK_MAX)
+		return -EINVAL;
+	mutex_lock(&i8042_mutex);
+	if (ports[num - 1].dev)
+		loopback_run(&ports[num - 1], count, 1);
+	mutex_unlock(&i8042_mutex);
+	return ports[num - 1].dev ? len : -ENODEV;
+}
+
+static const struct file_operations loopback_fops = {
+	.owner = THIS_MODULE,
+	.open = loopback_open,
+	.read = seq_read,
+	.write = loopback_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	int i, j;
+	u64 calls;
+	u32 rem;
+	struct i8042_stats *st;
+
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		st = &ports[i].stats;
+		seq_printf(m, "%s port:\n", ports[i].name);
+		seq_printf(m, "  events: %llu\n", st->events);
+		seq_printf(m, "  overflows: %u\n", st->overflows);
+		seq_printf(m, "  latency_ns: avg %llu max %llu\n",
+			   st->events ? div64_u64(st->lat_sum_ns, st->events) : 0, st->lat_max_ns);
+		seq_puts(m, "  latency_hist_us:");
+		for (j = 0; j < I8042_HIST_SIZE; j++)
+			seq_printf(m, " %u", st->lat_hist[j]);
+		seq_putc(m, '\n');
+		seq_printf(m, "  commands: %llu errors %u\n", st->cmds, st->cmd_errors);
+		seq_printf(m, "  command_ns: avg %llu max %llu\n",
+			   st->cmds ? div64_u64(st->cmd_lat_sum_ns, st->cmds) : 0, st->cmd_lat_max_ns);
+		seq_puts(m, "  command_hist_us:");
+		for (j = 0; j < I8042_HIST_SIZE; j++)
+			seq_printf(m, " %u", st->cmd_hist[j]);
+		seq_putc(m, '\n');
+		seq_printf(m, "  command_pacing: deferred %u avoided %u forced %u\n",
+			   st->cmd_deferred, st->cmd_avoided, st->cmd_forced);
+		calls = st->events ? div64_u64(st->input_calls * 100, st->events) : 0;
+		calls = div_u64_rem(calls, 100, &rem);
+		seq_printf(m, "  delivery: input_calls %llu (%llu.%02u per event) cycles %llu (%llu per event)\n",
+			   st->input_calls, calls, rem, st->cycles,
+			   st->events ? div64_u64(st->cycles, st->events) : 0);
+		if (ports[i].type == MOUSE && ports[i].clock.period_ns) {
+			seq_printf(m, "  sample_rate_mhz: nominal %u000 estimated %llu\n", ports[i].rate,
+				   div64_u64(NSEC_PER_SEC * 1000ULL, ports[i].clock.period_ns));
+			seq_printf(m, "  jitter_ns: samples %llu avg %llu max %llu\n", ports[i].clock.samples,
+				   ports[i].clock.samples ?
+				   div64_u64(ports[i].clock.jitter_sum_ns, ports[i].clock.samples) : 0,
+				   ports[i].clock.jitter_max_ns);
 		}
-		if (read_reg(&byte, 250) < 0) {
-			printk(KERN_ERR "i8042: time limit exceeded\n");
-			error = -ETIME;
-			if (first_port)
-				goto err_first_irq12_free;
-			else
-				goto err_second_irq12_free;
+	}
+	seq_printf(m, "wake_to_event_us: %lld\n", div_s64(wake.latency_ns, NSEC_PER_USEC));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static void debugfs_init(void)
+{
+	debugfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("loopback", 0600, debugfs_dir, NULL, &loopback_fops);
+	debugfs_create_file("stats", 0400, debugfs_dir, NULL, &stats_fops);
+}
+
+/* Keyboard irq wakes system, ports stay enabled so the waking key is buffered */
+static int i8042_suspend(struct device *dev)
+{
+	int i;
+	struct i8042_port *port;
+
+	if (!device_may_wakeup(dev))
+		return 0;
+	/* Single output buffer must stay free for the waking key, so other ports are stopped */
+	mutex_lock(&i8042_mutex);
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		port = &ports[i];
+		if (!port->dev)
+			continue;
+		if (port->type == KEYBOARD && port->irq_on && !wake.armed) {
+			wake.armed = !enable_irq_wake(port->irq);
+			wake.irq = port->irq;
+		} else {
+			outb(port->num == 1 ? I8042_DISABLE_FIRST_PS2_PORT : I8042_DISABLE_SECOND_PS2_PORT,
+			     I8042_COMMAND_REG);
 		}
 	}
+	mutex_unlock(&i8042_mutex);
+	return 0;
+}
+
+/* Runs before irqs are delivered, so pending bytes can't be drained or flushed first */
+static int i8042_resume_noirq(struct device *dev)
+{
+	int i;
+	uint8_t status;
+	unsigned long flags;
+	struct i8042_port *port;
 
+	WRITE_ONCE(wake.resumed, ktime_get());
+	wake.count = 0;
+	status = inb(I8042_STATUS_REG);
+	while (test_bit(0, (void *) &status) && wake.count < I8042_BUFFER_SIZE) {
+		wake.port[wake.count] = test_bit(5, (void *) &status) ? 1 : 0;
+		wake.bytes[wake.count].t = ktime_get();
+		wake.bytes[wake.count].data = inb(I8042_DATA_REG);
+		wake.count++;
+		status = inb(I8042_STATUS_REG);
+	}
 
+	/* Firmware may have reset controller */
+	outb(I8042_WRITE_CONFIG_BYTE, I8042_COMMAND_REG);
+	if (write_dev1(config_byte, cmd_timeout) < 0)
+		printk(KERN_WARNING "i8042: can't restore config byte on resume\n");
+	for (i = 0; i < ARRAY_SIZE(ports); i++)
+		if (ports[i].dev)
+			outb(i == 0 ? I8042_ENABLE_FIRST_PS2_PORT : I8042_ENABLE_SECOND_PS2_PORT,
+			     I8042_COMMAND_REG);
+
+	/* Captured bytes keep their arrival time and go to decoder as if they were drained */
+	spin_lock_irqsave(&i8042_lock, flags);
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		ports[i].packet_len = 0;
+		ports[i].e0 = ports[i].f0 = 0;
+		ports[i].clock.reset = 1;
+	}
+	for (i = 0; i < wake.count; i++) {
+		port = &ports[wake.port[i]];
+		if (!port->dev || (port->head + 1) % I8042_RING_SIZE == port->tail)
+			continue;
+		port->ring[port->head] = wake.bytes[i];
+		port->head = (port->head + 1) % I8042_RING_SIZE;
+		port->last_rx = wake.bytes[i].t;
+	}
+	spin_unlock_irqrestore(&i8042_lock, flags);
+	if (wake.count) {
+		printk(KERN_INFO "i8042: %d bytes captured on resume\n", wake.count);
+		tasklet_schedule(&i8042_tasklet);
+	}
 	return 0;
+}
 
-err_first_irq12_free:
-	free_irq(I8042_IRQ12, dev2);
-err_first_dev2_unreg:
-	input_unregister_device(dev2);
-err_irq1_free:
-	free_irq(I8042_IRQ1, dev1);
-err_dev1_unreg:
-	input_unregister_device(dev1);
-	return error;
+/* Devices reset by firmware are enabled again, settings are restored through command engine */
+static int i8042_resume(struct device *dev)
+{
+	int i;
+	uint8_t byte = I8042_KBD_ENABLE;
 
-err_second_irq12_free:
-	free_irq(I8042_IRQ12, dev2);
-err_second_dev2_unreg:
-	input_unregister_device(dev2);
-	return error;
+	if (wake.armed) {
+		disable_irq_wake(wake.irq);
+		wake.armed = 0;
+	}
+	for (i = 0; i < ARRAY_SIZE(ports); i++)
+		if (ports[i].dev && i8042_command(&ports[i], &byte, 1, NULL, 0))
+			printk(KERN_WARNING "i8042: can't enable device on %s port\n", ports[i].name);
+	if (profile_set) {
+		mutex_lock(&profile_mutex);
+		apply_port_profile(&ports[0]);
+		apply_port_profile(&ports[1]);
+		mutex_unlock(&profile_mutex);
+	}
+	for (i = 0; i < ARRAY_SIZE(ports); i++)
+		if (ports[i].dev && ports[i].type == KEYBOARD)
+			schedule_work(&ports[i].led_work);
+	return 0;
+}
 
-err_dev1_free:
-	input_free_device(dev1);
-	return error;
+static const struct dev_pm_ops i8042_pm_ops = {
+	.suspend = i8042_suspend,
+	.resume_noirq = i8042_resume_noirq,
+	.resume = i8042_resume,
+};
 
-err_first_dev2_free:
-	input_free_device(dev2);
-	free_irq(I8042_IRQ1, dev1);
-	input_unregister_device(dev1);
-	return error;
+static int i8042_pdev_probe(struct platform_device *pdev)
+{
+	device_init_wakeup(&pdev->dev, true);
+	return 0;
+}
+
+static struct platform_driver i8042_pdrv = {
+	.driver = {
+		.name = KBUILD_MODNAME,
+		.pm = &i8042_pm_ops,
+	},
+	.probe = i8042_pdev_probe,
+};
+
+/* Platform device only carries power management of ports set up by init */
+static void pm_init(void)
+{
+	if (platform_driver_register(&i8042_pdrv)) {
+		printk(KERN_WARNING "i8042: can't register platform driver, suspend is not handled\n");
+		return;
+	}
+	i8042_pdev = platform_device_register_simple(KBUILD_MODNAME, -1, NULL, 0);
+	if (IS_ERR(i8042_pdev)) {
+		printk(KERN_WARNING "i8042: can't register platform device, suspend is not handled\n");
+		platform_driver_unregister(&i8042_pdrv);
+		i8042_pdev = NULL;
+	}
+}
 
-err_second_dev2_free:
-	input_free_device(dev2);
+static void pm_exit(void)
+{
+	if (!i8042_pdev)
+		return;
+	device_init_wakeup(&i8042_pdev->dev, false);
+	platform_device_unregister(i8042_pdev);
+	platform_driver_unregister(&i8042_pdrv);
+}
+
+static int __init i8042_init(void)
+{
+	int i, error = 0;
+	ktime_t start = ktime_get();
+
+	init_completion(&loopback.done);
+	mutex_init(&loopback.mutex);
+	init_completion(&ports[0].cmd_done);
+	init_completion(&ports[1].cmd_done);
+	INIT_WORK(&ports[0].led_work, led_work_fn);
+	INIT_WORK(&ports[1].led_work, led_work_fn);
+
+	apply_quirks();
+	mutex_lock(&i8042_mutex);
+	if (handover.valid) {
+		error = restore_handover();
+		if (error) {
+			printk(KERN_INFO "i8042: topology handover rejected, probing\n");
+		} else {
+			printk(KERN_INFO "i8042: topology restored from handover\n");
+		}
+	}
+	if (!handover.valid || error) {
+		/* Rejected handover may have already restored fields of first port */
+		for (i = 0; i < ARRAY_SIZE(ports); i++) {
+			ports[i].present = ports[i].type = ports[i].rate = ports[i].set = 0;
+			ports[i].id = ports[i].id2 = 0;
+		}
+		error = probe_controller();
+		if (error)
+			goto err_unlock;
+	}
+
+	/* Keyboard is probed synchronously to be usable as early as possible */
+	if (ports[0].present) {
+		error = setup_port(&ports[0]);
+		if (error && error != -ENODEV)
+			goto err_unlock;
+	}
+	if (ports[0].dev)
+		printk(KERN_INFO "i8042: keyboard ready in %lld us, %llu ms after boot\n",
+		       ktime_us_delta(ktime_get(), start),
+		       div_u64(ktime_get_boottime_ns(), NSEC_PER_MSEC));
+
+	/* Polling timer is not running yet, so second port can't be deferred in polling mode */
+	if (ports[1].present) {
+		if ((early_phases & I8042_EARLY_AUX) || (quirks & I8042_QUIRK_POLL)) {
+			error = setup_port(&ports[1]);
+			if (error && error != -ENODEV) {
+				mutex_unlock(&i8042_mutex);
+				release_port(&ports[0]);
+				return error;
+			}
+		} else {
+			schedule_work(&aux_work);
+		}
+	}
+
+	start_polling();
+	mutex_unlock(&i8042_mutex);
+	if (profile_set) {
+		mutex_lock(&profile_mutex);
+		apply_port_profile(&ports[0]);
+		apply_port_profile(&ports[1]);
+		mutex_unlock(&profile_mutex);
+	}
+	debugfs_init();
+	pm_init();
+	if (genl_register_family(&i8042_genl_family)) {
+		printk(KERN_WARNING "i8042: can't register netlink family\n");
+	} else {
+		genl_registered = 1;
+		if (netlink_interval)
+			schedule_delayed_work(&genl_notify_work, msecs_to_jiffies(netlink_interval));
+	}
+
+	printk(KERN_INFO "i8042: %u stale bytes flushed\n", flushed_bytes);
+	return 0;
+
+err_unlock:
+	mutex_unlock(&i8042_mutex);
 	return error;
 }
 
-void cleanup_module(void)
+static void __exit i8042_exit(void)
 {
-	if (first_port) {
-		free_irq(I8042_IRQ1, dev1);
-		input_unregister_device(dev1);
+	pm_exit();
+	debugfs_remove_recursive(debugfs_dir);
+	if (genl_registered) {
+		cancel_delayed_work_sync(&genl_notify_work);
+		genl_unregister_family(&i8042_genl_family);
 	}
-	if (second_port) {
-		free_irq(I8042_IRQ12, dev2);
-		input_unregister_device(dev2);
+	cancel_work_sync(&aux_work);
+	if (poll_timer_on) {
+		timer_shutdown_sync(&poll_timer);
+		poll_timer_on = 0;
 	}
+	release_port(&ports[1]);
+	release_port(&ports[0]);
+	tasklet_kill(&i8042_tasklet);
+	cancel_work_sync(&qos_on_work);
+	cancel_delayed_work_sync(&qos_off_work);
+	if (qos_active)
+		cpu_latency_qos_remove_request(&qos_req);
 }
+
+#ifdef MODULE
+module_init(i8042_init);
+#else
+/* Built-in driver starts right after input core */
+subsys_initcall_sync(i8042_init);
+#endif
+module_exit(i8042_exit);
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2021 Danish Makbari
+ *
+ *     This program is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 2 of the License, or
+ *     any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _I8042_DRIVER_H
+#define _I8042_DRIVER_H
+
+/* Generic netlink family exporting per-port metrics */
+#define I8042_GENL_NAME "i8042"
+#define I8042_GENL_VERSION 1
+#define I8042_GENL_MCGRP_NAME "stats"
+
+enum {
+	I8042_GENL_CMD_UNSPEC,
+	I8042_GENL_CMD_GET_STATS,	/* dump, also sent to "stats" group periodically */
+	__I8042_GENL_CMD_MAX,
+};
+
+enum {
+	I8042_GENL_ATTR_UNSPEC,
+	I8042_GENL_ATTR_PAD,
+	I8042_GENL_ATTR_PORT,		/* u8, 1 or 2 */
+	I8042_GENL_ATTR_TYPE,		/* u8, 1 keyboard, 2 mouse */
+	I8042_GENL_ATTR_EVENTS,		/* u64 */
+	I8042_GENL_ATTR_OVERFLOWS,	/* u32 */
+	I8042_GENL_ATTR_LAT_SUM_NS,	/* u64, irq to input core */
+	I8042_GENL_ATTR_LAT_MAX_NS,	/* u64 */
+	I8042_GENL_ATTR_LAT_HIST,	/* u32 array, log2 buckets from 1 us */
+	I8042_GENL_ATTR_CMDS,		/* u64 */
+	I8042_GENL_ATTR_CMD_ERRORS,	/* u32 */
+	I8042_GENL_ATTR_CMD_SUM_NS,	/* u64, command submission to completion */
+	I8042_GENL_ATTR_CMD_MAX_NS,	/* u64 */
+	I8042_GENL_ATTR_CMD_HIST,	/* u32 array, log2 buckets from 1 us */
+	__I8042_GENL_ATTR_MAX,
+};
+#define I8042_GENL_ATTR_MAX (__I8042_GENL_ATTR_MAX - 1)
+
+#ifdef __KERNEL__
+#include <linux/list.h>
+#include <linux/types.h>
+
+/* Port types returned by i8042_port_type() */
+#define I8042_PORT_NONE 0
+#define I8042_PORT_KEYBOARD 1
+#define I8042_PORT_MOUSE 2
+
+/* Command and parameters sent to device by command engine */
+#define I8042_CMD_MAX 4
+
+struct i8042_cmd {
+	struct list_head node;		/* used by driver */
+	uint8_t bytes[I8042_CMD_MAX];
+	int nbytes;
+	uint8_t resp[I8042_CMD_MAX];	/* bytes received after last acknowledge */
+	int nresp;
+	int status;			/* -EINPROGRESS until done, then 0 or negative error */
+	void (*done)(struct i8042_cmd *cmd);
+	void *context;
+};
+
+int i8042_submit_command(int port, struct i8042_cmd *cmd);
+int i8042_port_type(int port);
+#endif
+
+#endif
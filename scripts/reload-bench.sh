@@ -0,0 +1,184 @@
+#!/bin/sh
+#
+# Loops insmod/rmmod of i8042_driver and reports reload times and leaks.
+#
+# On host it boots QEMU, whose pc machine has emulated i8042:
+#	scripts/reload-bench.sh -k bzImage -i busybox.cpio.gz [-n 300] [-b baseline.txt]
+# Kernel must have serio i8042, atkbd and psmouse built as modules or not at all,
+# initramfs must have busybox. Module must be built against that kernel, not
+# the host one (make reload-bench GUEST_KDIR=... does it), it is taken from
+# current directory. Results go to reload-bench.csv and reload-bench.txt.
+#
+# Inside guest (or any machine without other i8042 driver) it runs the loop itself:
+#	scripts/reload-bench.sh -g [-n 300] [-m i8042_driver.ko]
+#
+# Any irq or input device left after rmmod fails the run. Summary can be compared
+# with reload-bench.txt of another commit, median times slower by more than
+# threshold percent fail the run too.
+
+cycles=300
+module=i8042_driver.ko
+kernel=
+initrd=
+baseline=
+threshold=20
+guest=0
+csv=reload-bench.csv
+summary=reload-bench.txt
+
+usage() {
+	echo "usage: $0 [-g] [-k kernel -i initrd] [-n cycles] [-m module] [-b baseline] [-t percent]" >&2
+	exit 2
+}
+
+while getopts "gk:i:n:m:b:t:" opt; do
+	case $opt in
+	g) guest=1 ;;
+	k) kernel=$OPTARG ;;
+	i) initrd=$OPTARG ;;
+	n) cycles=$OPTARG ;;
+	m) module=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+# Number of input devices registered by driver
+count_inputs() {
+	cat /sys/class/input/input*/name 2>/dev/null | grep -c '^i8042_dev'
+}
+
+# Number of irq lines requested by driver
+count_irqs() {
+	grep -c 'i8042_dev' /proc/interrupts
+}
+
+mem_kb() {
+	awk '/^MemAvailable:/ { print $2 }' /proc/meminfo
+}
+
+# Registration is finished when every port seen on first load has its device
+wait_inputs() {
+	n=0
+	while [ "$(count_inputs)" -lt "$1" ] && [ $n -lt 2000 ]; do
+		n=$((n + 1))
+		usleep 500 2>/dev/null || sleep 0.0005
+	done
+}
+
+run_guest() {
+	echo "cycle,load_us,reg_us,unload_us,irqs_loaded,irqs_left,inputs_left,mem_avail_kb"
+	insmod "$module" || exit 1
+	sleep 1
+	ports=$(count_inputs)
+	rmmod i8042_driver || exit 1
+
+	i=1
+	while [ $i -le "$cycles" ]; do
+		t0=$(now_us)
+		insmod "$module" || exit 1
+		t1=$(now_us)
+		wait_inputs "$ports"
+		t2=$(now_us)
+		irqs=$(count_irqs)
+		t3=$(now_us)
+		rmmod i8042_driver || exit 1
+		t4=$(now_us)
+		echo "$i,$((t1 - t0)),$((t2 - t0)),$((t4 - t3)),$irqs,$(count_irqs),$(count_inputs),$(mem_kb)"
+		i=$((i + 1))
+	done
+}
+
+median() {
+	cut -d, -f"$1" | sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+summarize() {
+	data=$(tail -n +2 "$csv")
+	{
+		echo "cycles $(echo "$data" | wc -l)"
+		echo "load_us $(echo "$data" | median 2)"
+		echo "reg_us $(echo "$data" | median 3)"
+		echo "unload_us $(echo "$data" | median 4)"
+		echo "irq_leaks $(echo "$data" | awk -F, '$6 != 0' | wc -l)"
+		echo "input_leaks $(echo "$data" | awk -F, '$7 != 0' | wc -l)"
+		echo "mem_growth_kb $(echo "$data" | awk -F, 'NR == 1 { first = $8 } { last = $8 } END { print first - last }')"
+	} > "$summary"
+	cat "$summary"
+}
+
+value() {
+	awk -v k="$1" '$1 == k { print $2 }' "$2"
+}
+
+# Prints leaks, returns 1 if there were any
+check_leaks() {
+	status=0
+	for key in irq_leaks input_leaks; do
+		if [ "$(value $key "$summary")" != 0 ]; then
+			echo "LEAK: $key in $(value $key "$summary") cycles"
+			status=1
+		fi
+	done
+	return $status
+}
+
+# Prints regressions against baseline, returns 1 if there were any
+compare() {
+	status=0
+	for key in load_us reg_us unload_us; do
+		old=$(value $key "$baseline")
+		new=$(value $key "$summary")
+		[ -n "$old" ] && [ "$old" -gt 0 ] || continue
+		if [ $((new * 100)) -gt $((old * (100 + threshold))) ]; then
+			echo "REGRESSION: $key $old -> $new us"
+			status=1
+		fi
+	done
+	return $status
+}
+
+# Appends module, this script and init to busybox initramfs and boots it
+run_qemu() {
+	dir=$(mktemp -d)
+	cp "$module" "$dir/i8042_driver.ko"
+	cp "$0" "$dir/reload-bench.sh"
+	cat > "$dir/init" <<-EOF
+	#!/bin/sh
+	mount -t proc proc /proc
+	mount -t sysfs sysfs /sys
+	echo "--- reload-bench start"
+	sh /reload-bench.sh -g -n $cycles -m /i8042_driver.ko
+	echo "--- reload-bench end"
+	poweroff -f
+	EOF
+	chmod +x "$dir/init"
+	(cd "$dir" && find init i8042_driver.ko reload-bench.sh | cpio -o -H newc 2>/dev/null | gzip) > "$dir/bench.cpio.gz"
+	cat "$initrd" "$dir/bench.cpio.gz" > "$dir/initrd"
+
+	qemu-system-x86_64 -machine pc -m 512 -nographic -no-reboot \
+		${KVM:+-enable-kvm} -kernel "$kernel" -initrd "$dir/initrd" \
+		-append "console=ttyS0 rdinit=/init quiet modprobe.blacklist=i8042,atkbd,psmouse" \
+		| tr -d '\r' | sed -n '/^--- reload-bench start/,/^--- reload-bench end/p' \
+		| grep -E '^(cycle|[0-9]+),' > "$csv"
+	rm -rf "$dir"
+}
+
+if [ $guest -eq 1 ]; then
+	run_guest
+	exit 0
+fi
+
+[ -n "$kernel" ] && [ -n "$initrd" ] || usage
+run_qemu
+[ -s "$csv" ] || { echo "no results, see QEMU console output" >&2; exit 1; }
+summarize
+failed=0
+check_leaks || failed=1
+[ -z "$baseline" ] || compare || failed=1
+exit $failed